@@ -0,0 +1,276 @@
+// fatlabel - v1 - list FAT filesystem labels in devices and disk images
+// gcc -Wall -std=c99 -pthread -o fatlabel fatlabel.c
+// Copyright 2019 Patrick Gaskin
+// License: MIT License
+
+#define FATLABEL_IMPLEMENTATION
+#include "fatlabel.h"
+
+#include <ftw.h>
+
+typedef struct scan_opts_t {
+    bool            json;
+    bool            first;   // stop after the first match
+    const char     *label;   // only show volumes with this label (not case-sensitive), or NULL
+    const char     *serial;  // only show volumes with this serial (XXXX-XXXX), or NULL
+    bool            verbose; // show errors for files which aren't disk images
+    bool            stats;   // show the latency and I/O of each probe on stderr
+    bool            cold;    // drop the cached pages of each file before probing it
+    uint64_t       *lat;     // latency of each probe in us (if stats)
+    pthread_mutex_t out;     // for stdout
+    size_t          matches;
+} scan_opts_t;
+
+// nftw doesn't take a user pointer, so the files are collected here.
+static char **files;
+static size_t files_n, files_alloc;
+
+static int add_file(const char *path) {
+    if (files_n == files_alloc) {
+        size_t alloc = files_alloc ? files_alloc * 2 : 64;
+        char **tmp = realloc(files, alloc * sizeof(char*));
+        if (!tmp)
+            return -1;
+        files = tmp;
+        files_alloc = alloc;
+    }
+    if (!(files[files_n] = strdup(path)))
+        return -1;
+    files_n++;
+    return 0;
+}
+
+static int walk_fn(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void) ftw;
+    if (flag == FTW_F && (S_ISREG(st->st_mode) || S_ISBLK(st->st_mode)))
+        return add_file(path);
+    if (flag == FTW_DNR)
+        fprintf(stderr, "Warning: could not read directory %s\n", path);
+    return 0;
+}
+
+// print_str prints a path or label escaped for JSON or TSV. Paths are passed
+// through as-is (they are usually UTF-8). Labels are in the OEM code page, so
+// if label is true, other bytes are treated as Latin-1 to keep the output
+// valid UTF-8.
+static void print_str(const char *s, bool json, bool label) {
+    if (json)
+        putchar('"');
+    for (const uint8_t *c = (const uint8_t*) s; *c; c++) {
+        if (*c == '\\' || (json && *c == '"'))
+            printf("\\%c", *c);
+        else if (!json && *c == '\t')
+            printf("\\t");
+        else if (*c < 0x20 || *c == 0x7F || (label && *c > 0x7F))
+            printf(json ? "\\u%04x" : "\\x%02x", *c);
+        else
+            putchar(*c);
+    }
+    if (json)
+        putchar('"');
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static bool scan_probe(void *data, size_t i, const char *path) {
+    scan_opts_t *o = data;
+    struct fatlabel_part *parts;
+    struct fatlabel_io io;
+    size_t n;
+    bool stop = false;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Warning: could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (o->cold)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    fatlabel_io(&io, true);
+    uint64_t start = now_us();
+    int r = fatlabel_partitions(fd, &parts, &n);
+    int r_errno = errno;
+    if (o->stats) {
+        o->lat[i] = now_us() - start;
+        fatlabel_io(&io, true);
+        fprintf(stderr, "Stats: %s: %llu us, %llu reads, %llu bytes read, %llu bytes mapped\n", path,
+            (unsigned long long) o->lat[i], (unsigned long long) io.reads, (unsigned long long) io.bytes, (unsigned long long) io.mapped);
+    }
+    close(fd);
+
+    if (r) {
+        if (o->verbose || r_errno != EINVAL)
+            fprintf(stderr, "Warning: could not read %s: %s\n", path, strerror(r_errno));
+        return false;
+    }
+
+    pthread_mutex_lock(&o->out);
+    for (size_t j = 0; j < n && !stop; j++) {
+        const struct fatlabel_part *p = &parts[j];
+        if (!p->fat)
+            continue;
+
+        char serial[10];
+        snprintf(serial, sizeof(serial), "%04X-%04X", p->info.serno >> 16, p->info.serno & 0xFFFF);
+        if (o->serial && strcasecmp(o->serial, serial))
+            continue;
+        if (o->label && strcasecmp(o->label, p->info.boot_label) && strcasecmp(o->label, p->info.volume_label))
+            continue;
+
+        if (o->json) {
+            printf("%s\n  {\"path\": ", o->matches ? "," : "");
+            print_str(path, true, false);
+            printf(", \"partition\": %d, \"offset\": %llu, \"type\": \"FAT%d\", \"serial\": \"%s\", \"boot_label\": ",
+                p->index, (unsigned long long) p->off, p->info.fat_type, serial);
+            print_str(p->info.boot_label, true, true);
+            printf(", \"volume_label\": ");
+            print_str(p->info.volume_label, true, true);
+            printf("}");
+        } else {
+            print_str(path, false, false);
+            printf("\t%d\t%llu\tFAT%d\t%s\t", p->index, (unsigned long long) p->off, p->info.fat_type, serial);
+            print_str(p->info.boot_label, false, true);
+            putchar('\t');
+            print_str(p->info.volume_label, false, true);
+            putchar('\n');
+        }
+        o->matches++;
+        stop = o->first;
+    }
+    pthread_mutex_unlock(&o->out);
+
+    free(parts);
+    return stop;
+}
+
+static void usage(const char *argv0) {
+    printf("Usage: %s [--json] [--label LABEL] [--serial XXXX-XXXX] [--first] [--verbose] [--stats [--cold]] [PATH...]\n", argv0);
+    printf("\nProbes files, block devices, and directories (recursively) for FAT filesystems,\n");
+    printf("including ones in MBR or GPT partitions of disk images. If no paths are\n");
+    printf("specified, the devices in /proc/partitions are used. Up to %d paths are probed\n", FATLABEL_THREADS);
+    printf("at once.\n");
+    printf("\nOutput (TSV, or a JSON array with --json):\n");
+    printf("    path, partition, offset, type, serial, boot_label, volume_label\n");
+    printf("\nWith --stats, the latency, number of reads, and bytes read for each path, and\n");
+    printf("the percentiles of the latencies, are written to stderr. With --cold, the\n");
+    printf("cached pages of each path are dropped first (otherwise, running it twice\n");
+    printf("measures warm probes).\n");
+    printf("\nExamples:\n");
+    printf("    fatlabel\n");
+    printf("    fatlabel --json images/ disk.img\n");
+    printf("    fatlabel --first --label BOOT /proc/partitions\n");
+}
+
+int main(int argc, char** argv) {
+    scan_opts_t o = {0};
+    char* argv0 = argv[0];
+    for (; argc > 1 && !strncmp(argv[1], "--", 2); argc--, argv++) {
+        if (!strcmp(argv[1], "--")) {
+            argc--, argv++;
+            break;
+        } else if (!strcmp(argv[1], "--json"))
+            o.json = true;
+        else if (!strcmp(argv[1], "--first"))
+            o.first = true;
+        else if (!strcmp(argv[1], "--verbose"))
+            o.verbose = true;
+        else if (!strcmp(argv[1], "--stats"))
+            o.stats = true;
+        else if (!strcmp(argv[1], "--cold"))
+            o.cold = true;
+        else if (!strcmp(argv[1], "--label") && argc > 2)
+            o.label = argv[2], argc--, argv++;
+        else if (!strcmp(argv[1], "--serial") && argc > 2)
+            o.serial = argv[2], argc--, argv++;
+        else if (!strcmp(argv[1], "--help")) {
+            usage(argv0);
+            return EXIT_SUCCESS;
+        } else {
+            printf("Error: unknown option %s\n", argv[1]);
+            usage(argv0);
+            return EXIT_FAILURE;
+        }
+    }
+
+    const char *def[] = {NULL, "/proc/partitions"};
+    if (argc == 1) {
+        argc = 2;
+        argv = (char**) def;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        struct stat st;
+        if (!strcmp(argv[i], "/proc/partitions")) {
+            char **devs;
+            size_t n;
+            if (fatlabel_list_devices(&devs, &n)) {
+                printf("Error: could not read /proc/partitions: %s\n", strerror(errno));
+                return EXIT_FAILURE;
+            }
+            int r = 0;
+            for (size_t j = 0; j < n; j++) {
+                if (!r)
+                    r = add_file(devs[j]);
+                free(devs[j]);
+            }
+            free(devs);
+            if (r) {
+                printf("Error: %s\n", strerror(errno));
+                return EXIT_FAILURE;
+            }
+        } else if (stat(argv[i], &st)) {
+            printf("Error: could not stat %s: %s\n", argv[i], strerror(errno));
+            return EXIT_FAILURE;
+        } else if (S_ISDIR(st.st_mode)) {
+            if (nftw(argv[i], walk_fn, 64, FTW_PHYS)) {
+                printf("Error: could not walk %s: %s\n", argv[i], strerror(errno));
+                return EXIT_FAILURE;
+            }
+        } else if (add_file(argv[i])) {
+            printf("Error: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    pthread_mutex_init(&o.out, NULL);
+    if (o.json)
+        printf("[");
+
+    // the options live until exit, so they don't need to be freed (the
+    // files are freed by fatlabel_scan_paths)
+    size_t total_n = files_n;
+    if (o.stats && files_n && !(o.lat = calloc(files_n, sizeof(uint64_t)))) {
+        printf("Error: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    uint64_t start = now_us();
+    if (fatlabel_scan_paths(files, files_n, scan_probe, &o, NULL)) {
+        printf("Error: could not start probing: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // a probe might still be writing if we stopped early
+    pthread_mutex_lock(&o.out);
+    if (o.json)
+        printf(o.matches ? "\n]\n" : "]\n");
+    fflush(stdout);
+
+    // the latencies are only complete if every file was probed
+    if (o.stats && total_n && !(o.first && o.matches)) {
+        uint64_t total = now_us() - start;
+        qsort(o.lat, total_n, sizeof(uint64_t), cmp_u64);
+        fprintf(stderr, "Stats: %zu paths in %llu us (p50 %llu us, p90 %llu us, p99 %llu us, max %llu us)\n", total_n, (unsigned long long) total,
+            (unsigned long long) o.lat[total_n / 2], (unsigned long long) o.lat[total_n * 9 / 10], (unsigned long long) o.lat[total_n * 99 / 100], (unsigned long long) o.lat[total_n - 1]);
+    }
+    return (o.label || o.serial) && !o.matches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,15 +1,57 @@
-/* fatlabel.h - v1 - single-file library to do stuff with FAT filesystem labels.
+/* fatlabel.h - v2 - single-file library to do stuff with FAT filesystem labels.
  * By: Patrick Gaskin
  *
  * Note: Requires C99 to compile. Only supports little-endian (due to the lack
  * of big-endian handling for the ints read from the FAT). Also uses _GNU_SOURCE
- * for asprintf. fatlabel_search only works on Linux.
+ * for asprintf. The implementation only builds on Linux: finding devices uses
+ * /proc/partitions, sysfs, and udev's by-label symlinks, fatlabel_wait and
+ * fatlabel_cache listen for uevents over netlink, fatlabel_copy uses
+ * copy_file_range and sendfile, and reads are hinted with posix_fadvise. It
+ * also requires pthreads, since fatlabel_search, fatlabel_search_ex,
+ * fatlabel_scan_all, and fatlabel_cache probe devices in parallel, and
+ * fatlabel_check scans the FAT in parallel.
  */
 
 #ifndef FATLABEL_H
 #define FATLABEL_H
 #define _GNU_SOURCE // asprintf
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#ifndef FATLABEL_THREADS
+#define FATLABEL_THREADS 8 // max number of devices to probe at once
+#endif
+
+#ifndef FATLABEL_WINDOW
+#define FATLABEL_WINDOW (128*1024) // bytes read up-front when probing
+#endif
+
+#ifndef FATLABEL_FAT_CHUNK
+#define FATLABEL_FAT_CHUNK (256*1024) // bytes of the FAT to load at a time
+#endif
+
+#ifndef FATLABEL_DCACHE_BUCKETS
+#define FATLABEL_DCACHE_BUCKETS 256 // size of the hash table for cached directory entries
+#endif
+
+#ifndef FATLABEL_STAT_CHUNK
+#define FATLABEL_STAT_CHUNK (1024*1024) // bytes of the FAT to read at a time when counting free clusters
+#endif
+
+#define FATLABEL_PROBE_MIN 512 // minimum scratch size for fatlabel_probe
+
+#ifndef FATLABEL_BY_LABEL
+#define FATLABEL_BY_LABEL "/dev/disk/by-label" // udev's label symlinks, checked before probing everything
+#endif
+
+#ifndef FATLABEL_UDEV_DATA
+#define FATLABEL_UDEV_DATA "/run/udev/data" // udev's database, used for partition types when ranking devices
+#endif
+
+#ifndef FATLABEL_MIN_SIZE
+#define FATLABEL_MIN_SIZE (32*1024) // devices smaller than this (in bytes) are never probed
+#endif
 
 #define FAT12_MAX 0xff4
 #define FAT16_MAX 0xfff4
@@ -85,10 +127,299 @@ struct vfat_dir_entry {
  */
 int fatlabel_get(const int fd, char **boot_label, char **volume_label, char **err);
 
+struct fatlabel_info {
+    char     boot_label[12];   // empty if not set
+    char     volume_label[12]; // empty if not found
+    uint32_t serno;
+    int      fat_type;         // 12, 16, or 32
+};
+
+/* fatlabel_probe is like fatlabel_get, but fills in info, and never allocates
+ * (which makes it suitable for probing many devices or images in a loop).
+ * The start of the device is read into scratch in one go, and the root
+ * directory and FAT are used from it where possible, so with FATLABEL_WINDOW
+ * bytes, most filesystems only need a single read. scratch must be at least
+ * FATLABEL_PROBE_MIN bytes (larger buffers mean fewer reads). On
+ * error, -1 is returned and errno is set (EINVAL if it isn't a FAT filesystem).
+ * If only the root directory couldn't be read, info is filled in except for
+ * the volume label.
+ */
+int fatlabel_probe(int fd, struct fatlabel_info *info, void *scratch, size_t scratch_sz);
+
+struct fatlabel_fsinfo {
+    const char *type;       // "vfat", "exfat", "ntfs", "ext2", "ext3", "ext4", or "iso9660"
+    char        label[128]; // as UTF-8 (empty if not set)
+    char        uuid[40];   // UUID or serial number, formatted like blkid does (empty if not set)
+    struct fatlabel_info fat; // if the type is vfat
+};
+
+/* fatlabel_probe_any is like fatlabel_probe, but also recognizes exFAT, NTFS,
+ * ext2/3/4, and ISO9660. The start of the device is read into scratch once,
+ * and shared by the signature checks for each filesystem (which only read
+ * more if their metadata is elsewhere). scratch should be at least 4 KiB to
+ * cover all of the superblocks. For FAT, the label is the one in the root
+ * directory if set, otherwise the one in the boot sector. On error, -1 is
+ * returned and errno is set (EINVAL if the filesystem isn't recognized).
+ */
+int fatlabel_probe_any(int fd, struct fatlabel_fsinfo *info, void *scratch, size_t scratch_sz);
+
+struct fatlabel_io {
+    uint64_t reads;  // number of read syscalls
+    uint64_t bytes;  // number of bytes read
+    uint64_t mapped; // number of bytes of FATs mapped instead of read (only touched pages are read)
+};
+
+/* fatlabel_io gets the I/O done by the fatlabel functions on the calling
+ * thread, for measuring probes. If reset is true, the counters are set to
+ * zero afterwards.
+ */
+void fatlabel_io(struct fatlabel_io *io, bool reset);
+
+struct fatlabel_stat {
+    uint32_t cluster_size; // bytes
+    uint32_t clusters;     // number of data clusters
+    uint32_t free;         // number of free clusters
+    uint32_t bad;          // number of clusters marked as bad (not counted if from_fsinfo)
+    bool     from_fsinfo;  // whether free was taken from the FAT32 FSInfo sector
+};
+
+/* fatlabel_stat gets the usage of a FAT filesystem without mounting it. If
+ * use_fsinfo is true and the filesystem is FAT32 with a valid free cluster
+ * count in the FSInfo sector, it is used as-is. Otherwise, the FAT is read in
+ * chunks of FATLABEL_STAT_CHUNK bytes and the free and bad entries are counted
+ * (using SIMD where available). On error, -1 is returned and errno is set
+ * (EINVAL if it isn't a FAT filesystem).
+ */
+int fatlabel_stat(int fd, struct fatlabel_stat *st, bool use_fsinfo);
+
+struct fatlabel_check {
+    uint32_t dirs;          // number of directories checked (including the root)
+    uint32_t files;         // number of files checked
+    uint32_t cross_links;   // clusters used by more than one chain
+    uint32_t loops;         // chains which loop back on themselves
+    uint32_t bad_chains;    // chains which run into a free, bad, or invalid cluster
+    uint32_t size_mismatch; // files whose size doesn't match the length of their chain
+    uint32_t lost_chains;   // allocated chains which aren't used by any entry
+    uint32_t lost_clusters; // number of clusters in the lost chains
+};
+
+/* fatlabel_check checks a FAT filesystem for problems without modifying it.
+ * The FAT is loaded up-front, and directories are walked by up to
+ * FATLABEL_THREADS threads, each one reading a directory's clusters in as few
+ * reads as possible. If report is not NULL, it is called with a description of
+ * each problem (possibly from another thread, but never concurrently). It
+ * returns 0 if the filesystem is consistent, 1 if there are problems, or -1 on
+ * error (errno is set).
+ */
+int fatlabel_check(int fd, struct fatlabel_check *res, void (*report)(void *data, const char *msg), void *data);
+
+struct fatlabel_volume {
+    char  *path;
+    dev_t  dev;
+    struct fatlabel_info info;
+};
+
+/* fatlabel_fs_t is a FAT filesystem opened for reading files. It is not safe to
+ * use from multiple threads at once.
+ */
+typedef struct fatlabel_fs fatlabel_fs_t;
+typedef struct fatlabel_dir fatlabel_dir_t;
+
+struct fatlabel_dirent {
+    char     name[768];      // long name (as UTF-8) if present, or the short name
+    char     short_name[13]; // 8.3 name
+    uint8_t  attr;
+    uint32_t cluster;        // first cluster (0 for the FAT12/16 root or empty files)
+    uint32_t size;
+};
+
+/* fatlabel_open opens the FAT filesystem in fd (which must stay open until it
+ * is closed). On error, NULL is returned and err is set (and must be freed).
+ */
+fatlabel_fs_t* fatlabel_open(int fd, char **err);
+
+/* fatlabel_open_at is like fatlabel_open, but for a filesystem starting at off
+ * bytes into fd (e.g. a partition in a disk image).
+ */
+fatlabel_fs_t* fatlabel_open_at(int fd, uint64_t off, char **err);
+
+/* fatlabel_close closes a filesystem opened by fatlabel_open. */
+void fatlabel_close(fatlabel_fs_t *fs);
+
+/* fatlabel_lookup looks up a path (not case-sensitive, separated by slashes,
+ * and relative to the root directory). Directory entries are cached, so
+ * repeated lookups don't need to read the directories again. On error, -1 is
+ * returned and errno is set.
+ */
+int fatlabel_lookup(fatlabel_fs_t *fs, const char *path, struct fatlabel_dirent *ent);
+
+/* fatlabel_opendir opens a directory for reading. On error, NULL is returned
+ * and errno is set.
+ */
+fatlabel_dir_t* fatlabel_opendir(fatlabel_fs_t *fs, const char *path);
+
+/* fatlabel_readdir reads the next entry from a directory (not including the
+ * dot entries). It returns 1 if an entry was read, 0 at the end, or -1 on error
+ * (errno is set).
+ */
+int fatlabel_readdir(fatlabel_dir_t *d, struct fatlabel_dirent *ent);
+
+/* fatlabel_closedir closes a directory opened by fatlabel_opendir. */
+void fatlabel_closedir(fatlabel_dir_t *d);
+
+/* fatlabel_pread reads up to n bytes from a file at off. It returns the number
+ * of bytes read (which is only less than n at the end of the file), or -1 on
+ * error (errno is set).
+ */
+ssize_t fatlabel_pread(fatlabel_fs_t *fs, const struct fatlabel_dirent *ent, void *buf, size_t n, uint64_t off);
+
+struct fatlabel_extent {
+    uint64_t file_off; // offset in the file
+    uint64_t dev_off;  // offset in fd (including the partition offset)
+    uint64_t len;
+};
+
+/* fatlabel_extents maps a file (or directory) onto the device as a list of
+ * extents, merging contiguous clusters. The array must be freed. On error, -1
+ * is returned, errno is set, and *extents is NULL.
+ */
+int fatlabel_extents(fatlabel_fs_t *fs, const struct fatlabel_dirent *ent, struct fatlabel_extent **extents, size_t *n);
+
+/* fatlabel_copy copies a file to out_fd (at its current position) one extent
+ * at a time using copy_file_range or sendfile where possible. It returns the
+ * number of bytes copied, or -1 on error (errno is set).
+ */
+ssize_t fatlabel_copy(fatlabel_fs_t *fs, const struct fatlabel_dirent *ent, int out_fd);
+
+struct fatlabel_part {
+    int      index; // partition number (1-4 primary, 5+ logical, or the GPT entry + 1), or 0 for the whole image
+    uint8_t  type;  // MBR partition type (0 for GPT)
+    uint64_t off;   // bytes
+    uint64_t len;   // bytes
+    bool     fat;   // whether info was filled in
+    struct fatlabel_info info;
+};
+
+/* fatlabel_partitions reads the MBR (including logical partitions) or GPT of a
+ * disk image (or whole disk) without needing a loop device, and probes each
+ * partition for a FAT filesystem. If the image itself is FAT, it is returned
+ * as the only entry. Only a few sectors are read for each partition. The
+ * array must be freed. On error, -1 is returned and errno is set (EINVAL if
+ * there is no partition table or filesystem).
+ */
+int fatlabel_partitions(int fd, struct fatlabel_part **parts, size_t *n);
+
 /* fatlabel_search searches for a device in /proc/partitions which has a specified
- * label (not case-sensitive). The returned path must be freed.
+ * label (not case-sensitive). The returned path must be freed. Up to
+ * FATLABEL_THREADS devices are probed at once, and the first one to match is
+ * returned (so it will not wait for slow devices if another one matches).
+ * Devices udev has a matching symlink for in FATLABEL_BY_LABEL are checked
+ * first, and partitions with a FAT type in the MBR are probed before others.
  */
 char* fatlabel_search(const char *label);
+
+#define FATLABEL_PROBE_MATCH      0 // the device has the label
+#define FATLABEL_PROBE_NO_MATCH   1 // the device has a filesystem with a different label
+#define FATLABEL_PROBE_NOT_FAT    2 // the device doesn't have a recognized filesystem
+#define FATLABEL_PROBE_ERROR      3 // the device couldn't be opened or read (see error)
+#define FATLABEL_PROBE_HUNG       4 // the device took longer than device_timeout_ms
+#define FATLABEL_PROBE_UNFINISHED 5 // the device was still being probed when the search finished
+
+struct fatlabel_probe_stats {
+    const char *path;
+    int         result;   // FATLABEL_PROBE_*
+    int         error;    // errno if the result is FATLABEL_PROBE_ERROR
+    uint64_t    open_us;  // time taken to open the device
+    uint64_t    total_us; // time taken to probe the device, including opening it
+    uint64_t    reads;    // number of read syscalls
+    uint64_t    bytes;    // number of bytes read
+};
+
+struct fatlabel_search_opts {
+    int   timeout_ms;        // total time to wait for a match (0 for no limit)
+    int   device_timeout_ms; // time to wait for each device (0 for no limit)
+    // hung is called from the calling thread for each device which is skipped
+    // because it took longer than device_timeout_ms.
+    void (*hung)(void *data, const char *path);
+    void *data;
+    bool  any_fs;            // match the labels of all filesystems supported by fatlabel_probe_any, not just FAT
+    // probed is called from the calling thread before returning, for each
+    // device which was probed (including hung ones, and ones which were still
+    // being probed). The stats are only valid during the call. Only the
+    // result and total_us are set for hung and unfinished probes.
+    void (*probed)(void *data, const struct fatlabel_probe_stats *st);
+};
+
+/* fatlabel_search_ex is like fatlabel_search, but gives up on devices which
+ * don't respond within the device timeout (the probe will continue in the
+ * background, but won't hold up the search), and returns NULL with errno set to
+ * ETIMEDOUT if there isn't a match within the total timeout.
+ */
+char* fatlabel_search_ex(const char *label, const struct fatlabel_search_opts *opts);
+
+/* fatlabel_wait waits for a device with the specified label to appear (or
+ * returns it right away if it already exists). Block devices which are added or
+ * changed are probed as soon as the kernel sends a uevent for them, so there
+ * isn't any polling. If timeout_ms is negative, it waits forever. On error or
+ * timeout (ETIMEDOUT), NULL is returned and errno is set. The returned path
+ * must be freed.
+ */
+char* fatlabel_wait(const char *label, int timeout_ms);
+
+/* fatlabel_scan_all probes every device in /proc/partitions once (up to
+ * FATLABEL_THREADS at a time), and returns the FAT filesystems in the order
+ * they are listed. The result must be freed with fatlabel_scan_free. On error,
+ * -1 is returned and errno is set.
+ */
+int fatlabel_scan_all(struct fatlabel_volume **vols, size_t *n);
+
+/* fatlabel_scan_free frees the result of fatlabel_scan_all. */
+void fatlabel_scan_free(struct fatlabel_volume *vols, size_t n);
+
+/* fatlabel_list_devices lists the paths of the devices in /proc/partitions
+ * which could contain a filesystem (the same ones fatlabel_search and
+ * fatlabel_scan_all probe). The array and each path must be freed. On error,
+ * -1 is returned and errno is set.
+ */
+int fatlabel_list_devices(char ***paths, size_t *n);
+
+/* fatlabel_scan_paths calls fn for each path from up to FATLABEL_THREADS
+ * threads at a time (fn does the probing, e.g. with fatlabel_partitions), and
+ * takes ownership of paths (the array and each path). It returns once every
+ * path is done, or as soon as fn returns true for one. In that case, no more
+ * are started, but calls which are already running aren't waited for (a probe
+ * which is stuck in the kernel can't be cancelled), so data must stay valid
+ * until free_data (which may be NULL) is called after the last one. On error,
+ * -1 is returned, errno is set, and paths and data are freed.
+ */
+int fatlabel_scan_paths(char **paths, size_t n, bool (*fn)(void *data, size_t i, const char *path), void *data, void (*free_data)(void *data));
+
+/* fatlabel_scan_resolve looks up many labels (not case-sensitive) or serial
+ * numbers (formatted as XXXX-XXXX) at once in the result of fatlabel_scan_all.
+ * For each key, the first matching volume (or NULL) is stored in out.
+ */
+void fatlabel_scan_resolve(const struct fatlabel_volume *vols, size_t n, const char **keys, size_t keys_n, const struct fatlabel_volume **out);
+
+/* fatlabel_cache_t caches the labels of the devices in /proc/partitions so
+ * repeated searches don't need to probe every device. Devices are re-probed
+ * when the kernel sends a uevent for them (if the uevent socket can't be
+ * opened, every search re-reads the superblocks, but will only re-read the
+ * root directory if it has changed). It is safe to use from multiple threads.
+ */
+typedef struct fatlabel_cache fatlabel_cache_t;
+
+/* fatlabel_cache_new creates a new cache. On error, NULL is returned and errno
+ * is set.
+ */
+fatlabel_cache_t* fatlabel_cache_new(void);
+
+/* fatlabel_cache_search is like fatlabel_search, but uses the cache. If there
+ * are multiple matches, the first one in /proc/partitions is returned.
+ */
+char* fatlabel_cache_search(fatlabel_cache_t *c, const char *label);
+
+/* fatlabel_cache_free frees the cache. */
+void fatlabel_cache_free(fatlabel_cache_t *c);
 #endif
 
 #ifdef FATLABEL_IMPLEMENTATION
@@ -98,7 +429,27 @@ char* fatlabel_search(const char *label);
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdbool.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/sysmacros.h>
+#include <linux/netlink.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 static uint8_t* vfat_dir_entry_get_volume_label(struct vfat_dir_entry *dir, int count) {
     for (; --count >= 0; dir++) {
@@ -117,140 +468,3354 @@ static uint8_t* vfat_dir_entry_get_volume_label(struct vfat_dir_entry *dir, int
     return NULL;
 }
 
-/* fatlabel_clean cleans an 11-character FAT label by removing trailing spaces
- * and converting it into a heap-allocated null-terminated string. The string
- * must be freed by the caller.
+/* fatlabel_clean cleans an 11-character FAT label by removing trailing
+ * spaces and converting it into a null-terminated string.
  */
-static char* fatlabel_clean(const uint8_t lbl[11]) {
-    char *nlbl;
-    asprintf(&nlbl, "%.11s", lbl);
+static void fatlabel_clean(const uint8_t lbl[11], char nlbl[12]) {
+    snprintf(nlbl, 12, "%.11s", lbl);
     for (int i = 11; i > 1; i--) {
         if ((nlbl[i] == ' ' || nlbl[i] == 0) && nlbl[i-1] != ' ') {
             nlbl[i] = 0;
             break;
         }
     }
-    return nlbl;
 }
 
-int fatlabel_get(const int fd, char **boot_label, char **volume_label, char **err) {
-    #define reterrs(...) {asprintf(err, __VA_ARGS__); free(sb); return -1;}
-    *boot_label = NULL;
-    *volume_label = NULL;
-    *err = NULL;
+static uint64_t fatlabel_hash(const void *buf, size_t n, bool fold) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const uint8_t *b = buf; n--; b++)
+        h = (h ^ (fold && *b >= 'A' && *b <= 'Z' ? *b + 32 : *b)) * 1099511628211ULL;
+    return h;
+}
 
-    struct vfat_super_block *sb = (struct vfat_super_block*) malloc(sizeof(struct vfat_super_block));
-    if (pread(fd, sb, sizeof(*sb), 0) != sizeof(*sb))
-        reterrs("error reading fat superblock: %s", strerror(errno));
+static __thread struct fatlabel_io fatlabel_io_tls;
+
+void fatlabel_io(struct fatlabel_io *io, bool reset) {
+    *io = fatlabel_io_tls;
+    if (reset)
+        fatlabel_io_tls = (struct fatlabel_io) {0};
+}
+
+/* fatlabel_src reads from a device through a window which is read in one go
+ * at the start (this covers the boot sector, the FATs, and the root directory
+ * on most small filesystems), and falls back to pread for anything else.
+ */
+struct fatlabel_src {
+    int      fd;
+    uint64_t base;   // offset of the filesystem in fd (e.g. a partition in an image)
+    uint8_t *win;
+    size_t   win_sz; // number of bytes read into win
+};
+
+/* fatlabel_src_init reads the window of up to win_cap bytes at base. On error,
+ * -1 is returned and errno is set.
+ */
+static int fatlabel_src_init(struct fatlabel_src *src, int fd, uint64_t base, uint8_t *win, size_t win_cap) {
+    src->fd = fd;
+    src->base = base;
+    src->win = win;
+    src->win_sz = 0;
+    while (src->win_sz < win_cap) {
+        ssize_t n = pread(fd, win + src->win_sz, win_cap - src->win_sz, base + src->win_sz);
+        fatlabel_io_tls.reads++;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        src->win_sz += n;
+        fatlabel_io_tls.bytes += n;
+    }
+    return 0;
+}
+
+/* fatlabel_src_ptr returns a pointer to n bytes at off if they are in the
+ * window, or NULL.
+ */
+static const void* fatlabel_src_ptr(struct fatlabel_src *src, size_t n, uint64_t off) {
+    if (off > src->win_sz || n > src->win_sz - off)
+        return NULL;
+    return src->win + off;
+}
+
+/* fatlabel_src_read reads n bytes at off (relative to the base). On error, -1 is returned and errno
+ * is set (EIO if the device is too short).
+ */
+static int fatlabel_src_read(struct fatlabel_src *src, void *buf, size_t n, uint64_t off) {
+    const void *p = fatlabel_src_ptr(src, n, off);
+    if (p) {
+        memcpy(buf, p, n);
+        return 0;
+    }
+    for (size_t r = 0; r < n;) {
+        ssize_t x = pread(src->fd, (uint8_t*) buf + r, n - r, src->base + off + r);
+        fatlabel_io_tls.reads++;
+        if (x < 0 && errno == EINTR)
+            continue;
+        if (x <= 0) {
+            if (x == 0)
+                errno = EIO;
+            return -1;
+        }
+        r += x;
+        fatlabel_io_tls.bytes += x;
+    }
+    return 0;
+}
+
+/* fatlabel_fat caches the first FAT of a filesystem for walking cluster chains.
+ * If the device is a regular file, the FAT is mapped into memory. Otherwise, it
+ * is read lazily in aligned chunks of FATLABEL_FAT_CHUNK bytes, which are kept
+ * until the cache is freed.
+ */
+struct fatlabel_fat {
+    struct fatlabel_src *src;
+    int       type;     // 12, 16, or 32
+    uint32_t  clusters; // number of data clusters
+    uint64_t  off;      // offset of the FAT
+    uint64_t  len;      // length of the FAT
+    uint8_t  *map;      // start of the FAT if mapped
+    void     *map_base;
+    size_t    map_sz;
+    uint8_t **chunks;   // otherwise, the loaded chunks (or NULL)
+};
+
+/* fatlabel_fat_type gets the FAT type from the number of data clusters. */
+static int fatlabel_fat_type(uint32_t clusters) {
+    return clusters <= FAT12_MAX ? 12 : clusters < FAT16_MAX ? 16 : 32;
+}
+
+/* fatlabel_fat_init initializes the FAT cache. On error, -1 is returned and
+ * errno is set.
+ */
+static int fatlabel_fat_init(struct fatlabel_fat *fat, struct fatlabel_src *src, uint32_t clusters, uint64_t off, uint64_t len) {
+    *fat = (struct fatlabel_fat) {
+        .src      = src,
+        .type     = fatlabel_fat_type(clusters),
+        .clusters = clusters,
+        .off      = off,
+        .len      = len,
+    };
+
+    // don't bother with the entries past the end of the data clusters
+    uint64_t used = fat->type == 12 ? ((uint64_t) clusters + 2) * 3 / 2 + 1 : ((uint64_t) clusters + 2) * (fat->type / 8);
+    if (used < fat->len)
+        fat->len = used;
+
+    struct stat st;
+    uint64_t abs = src->base + off;
+    if (!fstat(src->fd, &st) && S_ISREG(st.st_mode) && (uint64_t) st.st_size >= abs + fat->len) {
+        long pg = sysconf(_SC_PAGESIZE);
+        uint64_t base = abs - abs % pg;
+        fat->map_sz = abs + fat->len - base;
+        fat->map_base = mmap(NULL, fat->map_sz, PROT_READ, MAP_SHARED, src->fd, base);
+        if (fat->map_base != MAP_FAILED) {
+            fat->map = (uint8_t*) fat->map_base + (abs - base);
+            fatlabel_io_tls.mapped += fat->map_sz;
+            return 0;
+        }
+        fat->map_base = NULL;
+    }
+
+    if (!(fat->chunks = calloc((fat->len + FATLABEL_FAT_CHUNK - 1) / FATLABEL_FAT_CHUNK, sizeof(uint8_t*))))
+        return -1;
+    return 0;
+}
+
+static void fatlabel_fat_free(struct fatlabel_fat *fat) {
+    if (fat->map_base)
+        munmap(fat->map_base, fat->map_sz);
+    if (fat->chunks)
+        for (uint64_t i = 0; i < (fat->len + FATLABEL_FAT_CHUNK - 1) / FATLABEL_FAT_CHUNK; i++)
+            free(fat->chunks[i]);
+    free(fat->chunks);
+}
 
+/* fatlabel_fat_ptr returns a pointer to the byte at off in the FAT, which is
+ * valid up to the end of its chunk. On error, NULL is returned and errno is
+ * set.
+ */
+static const uint8_t* fatlabel_fat_ptr(struct fatlabel_fat *fat, uint64_t off) {
+    if (off >= fat->len) {
+        errno = ERANGE;
+        return NULL;
+    }
+    if (fat->map)
+        return fat->map + off;
+
+    uint64_t i = off / FATLABEL_FAT_CHUNK;
+    if (!fat->chunks[i]) {
+        uint64_t coff = i * FATLABEL_FAT_CHUNK;
+        size_t clen = fat->len - coff < FATLABEL_FAT_CHUNK ? fat->len - coff : FATLABEL_FAT_CHUNK;
+        uint8_t *chunk = malloc(clen);
+        if (!chunk)
+            return NULL;
+        if (fatlabel_src_read(fat->src, chunk, clen, fat->off + coff)) {
+            free(chunk);
+            return NULL;
+        }
+        fat->chunks[i] = chunk;
+    }
+    return fat->chunks[i] + off % FATLABEL_FAT_CHUNK;
+}
+
+/* fatlabel_fat_get gets the FAT entry for a cluster (with the reserved bits of
+ * FAT32 entries masked out). On error, -1 is returned and errno is set.
+ */
+static int fatlabel_fat_get(struct fatlabel_fat *fat, uint32_t cluster, uint32_t *val) {
+    const uint8_t *p, *q;
+    switch (fat->type) {
+    case 12:
+        // 12-bit entries are packed into 3 bytes per 2 entries, and may
+        // straddle a chunk
+        if (!(p = fatlabel_fat_ptr(fat, cluster + cluster/2)) || !(q = fatlabel_fat_ptr(fat, cluster + cluster/2 + 1)))
+            return -1;
+        *val = p[0] | (q[0] << 8);
+        *val = cluster & 1 ? *val >> 4 : *val & 0xfff;
+        return 0;
+    case 16:
+        if (!(p = fatlabel_fat_ptr(fat, (uint64_t) cluster * 2)))
+            return -1;
+        *val = p[0] | (p[1] << 8);
+        return 0;
+    default:
+        if (!(p = fatlabel_fat_ptr(fat, (uint64_t) cluster * 4)))
+            return -1;
+        *val = (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24)) & 0x0fffffff;
+        return 0;
+    }
+}
+
+/* fatlabel_fat_is_next checks if a FAT entry points to another cluster (i.e.
+ * it is not free, bad, the end of the chain, or out of range).
+ */
+static bool fatlabel_fat_is_next(struct fatlabel_fat *fat, uint32_t val) {
+    return val >= 2 && val < fat->clusters + 2;
+}
+
+/* fatlabel_geom is the layout of a filesystem. */
+struct fatlabel_geom {
+    int       type;          // 12, 16, or 32
+    uint32_t  clusters;      // number of data clusters
+    uint32_t  cluster_size;  // bytes
+    uint64_t  fat_off;       // offset of the first FAT
+    uint64_t  fat_len;       // length of each FAT
+    uint64_t  data_off;      // offset of cluster 2
+    uint64_t  root_off;      // offset of the root directory (FAT12/16)
+    uint32_t  root_entries;  // number of root directory entries (FAT12/16)
+    uint32_t  root_cluster;  // first cluster of the root directory (FAT32)
+};
+
+/* fatlabel_geom_init checks the superblock and computes the layout from it.
+ * On error, -1 is returned and the reason is written to msg (so it can be used
+ * without allocating).
+ */
+static int fatlabel_geom_init(struct fatlabel_geom *g, const struct vfat_super_block *sb, char *msg, size_t msg_sz) {
+    #define reterrs(...) {snprintf(msg, msg_sz, __VA_ARGS__); return -1;}
     if (sb->media != 0xf8 && sb->media != 0xf0)
         reterrs("unknown media type (probably not a FAT filesystem): %X", sb->media);
     if (sb->fats < 1 || sb->fats > 16)
         reterrs("unreasonable number of fats (probably not a FAT filesystem): %d", sb->fats)
     if (sb->sector_size_bytes == 0)
         reterrs("zero sector size (probably not a FAT filesystem)");
+    if (sb->sectors_per_cluster == 0)
+        reterrs("zero cluster size (probably not a FAT filesystem)");
 
     uint16_t sct_bytes = sb->sector_size_bytes;
     uint16_t reserved_sct = sb->reserved_sct;
     uint32_t total_sct = sb->sectors ? sb->sectors : sb->total_sect;
-    uint32_t fats_sct = (sb->fat_length ? sb->fat_length : sb->type.fat32.fat32_length) * sb->fats;
+    uint32_t fat_sct = sb->fat_length ? sb->fat_length : sb->type.fat32.fat32_length;
+    uint32_t fats_sct = fat_sct * sb->fats;
     uint16_t dirents = sb->dir_entries;
     uint16_t dirent_sct = (dirents*sizeof(struct vfat_dir_entry) + (sct_bytes-1)) / sct_bytes;
-    uint32_t clusters = (total_sct - (reserved_sct + fats_sct + dirent_sct)) / sb->sectors_per_cluster;
+    if (total_sct < reserved_sct + fats_sct + dirent_sct)
+        reterrs("filesystem too small (probably not a FAT filesystem)");
 
-    if (clusters >= FAT16_MAX) {
-        *boot_label = fatlabel_clean(sb->type.fat32.label);
+    g->clusters = (total_sct - (reserved_sct + fats_sct + dirent_sct)) / sb->sectors_per_cluster;
+    g->type = fatlabel_fat_type(g->clusters);
+    g->cluster_size = sb->sectors_per_cluster * sct_bytes;
+    g->fat_off = (uint64_t) reserved_sct * sct_bytes;
+    g->fat_len = (uint64_t) fat_sct * sct_bytes;
+    g->root_off = (uint64_t) (reserved_sct + fats_sct) * sct_bytes;
+    g->root_entries = g->type == 32 ? 0 : dirents;
+    g->root_cluster = g->type == 32 ? sb->type.fat32.root_cluster : 0;
+    g->data_off = (uint64_t) (reserved_sct + fats_sct + dirent_sct) * sct_bytes;
+    return 0;
+    #undef reterrs
+}
 
-        uint32_t start_data_sct = reserved_sct + fats_sct;
-        uint32_t cluster_size = sb->sectors_per_cluster * sct_bytes;
-        uint32_t root_cluster = sb->type.fat32.root_cluster;
-        int entries_per_cluster = cluster_size / sizeof(struct vfat_dir_entry);
+/* fatlabel_fs is an opened FAT filesystem. */
+struct fatlabel_fs {
+    struct fatlabel_src src;
+    struct fatlabel_fat fat;
+    uint8_t  *win;
+    const struct vfat_super_block *sb; // in win
+    int       type;          // 12, 16, or 32
+    uint32_t  clusters;      // number of data clusters
+    uint32_t  cluster_size;  // bytes
+    uint64_t  data_off;      // offset of cluster 2
+    uint64_t  root_off;      // offset of the root directory (FAT12/16)
+    uint32_t  root_entries;  // number of root directory entries (FAT12/16)
+    uint32_t  root_cluster;  // first cluster of the root directory (FAT32)
+    uint32_t  pos_first;     // last cluster looked up by fatlabel_fs_seek
+    uint32_t  pos_index;
+    uint32_t  pos_cluster;
+    struct fatlabel_dcache_ent *dcache[FATLABEL_DCACHE_BUCKETS];
+};
 
-        int maxloop = 100;
-        uint32_t next_cluster = root_cluster;
-        while (--maxloop) {
-            uint64_t next_off_sct = (uint64_t)(next_cluster - 2) * sb->sectors_per_cluster;
-            uint64_t next_off = (start_data_sct + next_off_sct) * sct_bytes;
+/* fatlabel_dcache_ent is a cached directory entry, keyed on the first cluster
+ * of the directory and the case-folded name it was looked up by.
+ */
+struct fatlabel_dcache_ent {
+    struct fatlabel_dcache_ent *next;
+    uint32_t parent;
+    uint64_t hash;
+    struct fatlabel_dirent ent;
+};
 
-            struct vfat_dir_entry* ents = (struct vfat_dir_entry*) malloc(cluster_size);
-            if (pread(fd, ents, sizeof(*ents), next_off) != sizeof(*ents))
-                reterrs("error reading root dirents: %s", strerror(errno));
+/* fatlabel_fs_init opens the filesystem at off in fd using a window of
+ * win_cap bytes at win, which must be valid until the filesystem is freed with
+ * fatlabel_fs_free. On error, -1 is returned and err is set.
+ */
+static int fatlabel_fs_init(struct fatlabel_fs *fs, int fd, uint64_t off, uint8_t *win, size_t win_cap, char **err) {
+    #define reterrs(...) {asprintf(err, __VA_ARGS__); return -1;}
+    *fs = (struct fatlabel_fs) {.win = win};
 
-            uint8_t *lbl = vfat_dir_entry_get_volume_label(ents, entries_per_cluster);
-            if (lbl) {
-                *volume_label = fatlabel_clean(lbl);
-                break;
+    if (fatlabel_src_init(&fs->src, fd, off, win, win_cap))
+        reterrs("error reading fat superblock: %s", strerror(errno));
+
+    const struct vfat_super_block *sb = fs->sb = fatlabel_src_ptr(&fs->src, sizeof(struct vfat_super_block), 0);
+    if (!sb)
+        reterrs("error reading fat superblock: %s", strerror(EIO));
+
+    char msg[128];
+    struct fatlabel_geom g;
+    if (fatlabel_geom_init(&g, sb, msg, sizeof(msg)))
+        reterrs("%s", msg);
+
+    fs->type = g.type;
+    fs->clusters = g.clusters;
+    fs->cluster_size = g.cluster_size;
+    fs->root_off = g.root_off;
+    fs->root_entries = g.root_entries;
+    fs->root_cluster = g.root_cluster;
+    fs->data_off = g.data_off;
+
+    if (fatlabel_fat_init(&fs->fat, &fs->src, fs->clusters, g.fat_off, g.fat_len))
+        reterrs("error reading fat: %s", strerror(errno));
+
+    return 0;
+    #undef reterrs
+}
+
+static void fatlabel_fs_free(struct fatlabel_fs *fs) {
+    fatlabel_fat_free(&fs->fat);
+    for (size_t i = 0; i < FATLABEL_DCACHE_BUCKETS; i++) {
+        for (struct fatlabel_dcache_ent *e = fs->dcache[i], *n; e; e = n) {
+            n = e->next;
+            free(e);
+        }
+    }
+}
+
+/* fatlabel_fs_cluster_off gets the offset of a data cluster. */
+static uint64_t fatlabel_fs_cluster_off(struct fatlabel_fs *fs, uint32_t cluster) {
+    return fs->data_off + (uint64_t) (cluster - 2) * fs->cluster_size;
+}
+
+/* fatlabel_fs_seek gets the index-th cluster in the chain starting at first,
+ * continuing from the last lookup if possible. On error, -1 is returned and
+ * errno is set (EIO if the chain is too short).
+ */
+static int fatlabel_fs_seek(struct fatlabel_fs *fs, uint32_t first, uint32_t index, uint32_t *cluster) {
+    uint32_t i = 0, c = first;
+    if (fs->pos_first == first && fs->pos_index <= index) {
+        i = fs->pos_index;
+        c = fs->pos_cluster;
+    }
+    for (; i <= index; i++) {
+        if (!fatlabel_fat_is_next(&fs->fat, c)) {
+            errno = EIO;
+            return -1;
+        }
+        if (i < index && fatlabel_fat_get(&fs->fat, c, &c))
+            return -1;
+    }
+    fs->pos_first = first;
+    fs->pos_index = index;
+    fs->pos_cluster = c;
+    *cluster = c;
+    return 0;
+}
+
+/* fatlabel_diriter iterates over the raw entries of a directory, stopping at
+ * the end marker.
+ */
+struct fatlabel_diriter {
+    struct fatlabel_fs *fs;
+    bool      fixed;   // FAT12/16 root directory
+    bool      end;     // found the end marker
+    uint32_t  cluster; // current cluster
+    uint32_t  steps;   // number of clusters followed
+    uint32_t  index;   // next entry in buf
+    uint32_t  count;   // number of entries in buf (0 if not loaded yet)
+    struct vfat_dir_entry *buf; // the current cluster (or the root directory)
+    const struct vfat_dir_entry *ents; // buf, or the window
+};
+
+/* fatlabel_diriter_init starts iterating over the directory starting at
+ * cluster (0 for the root directory). On error, -1 is returned and errno is
+ * set.
+ */
+static int fatlabel_diriter_init(struct fatlabel_diriter *it, struct fatlabel_fs *fs, uint32_t cluster) {
+    *it = (struct fatlabel_diriter) {
+        .fs      = fs,
+        .fixed   = cluster == 0 && fs->type != 32,
+        .cluster = cluster == 0 ? fs->root_cluster : cluster,
+    };
+    if (!it->fixed && !fatlabel_fat_is_next(&fs->fat, it->cluster)) {
+        errno = EIO;
+        return -1;
+    }
+    if (!it->fixed && !(it->buf = malloc(fs->cluster_size)))
+        return -1;
+    return 0;
+}
+
+static void fatlabel_diriter_free(struct fatlabel_diriter *it) {
+    free(it->buf);
+}
+
+/* fatlabel_diriter_next gets the next raw entry. It returns 1 if there is an
+ * entry, 0 at the end, or -1 on error (errno is set).
+ */
+static int fatlabel_diriter_next(struct fatlabel_diriter *it, const struct vfat_dir_entry **ent) {
+    if (it->end)
+        return 0;
+    if (it->index == it->count) {
+        struct fatlabel_fs *fs = it->fs;
+        if (it->fixed) {
+            if (it->count)
+                return 0;
+            size_t sz = fs->root_entries * sizeof(struct vfat_dir_entry);
+            if (!(it->ents = fatlabel_src_ptr(&fs->src, sz, fs->root_off))) {
+                if (!(it->buf = malloc(sz)))
+                    return -1;
+                if (fatlabel_src_read(&fs->src, it->buf, sz, fs->root_off))
+                    return -1;
+                it->ents = it->buf;
             }
+            it->count = fs->root_entries;
+        } else {
+            if (it->count) {
+                uint32_t next;
+                if (fatlabel_fat_get(&fs->fat, it->cluster, &next))
+                    return -1;
+                // the chain can't be longer than the number of clusters (if
+                // it is, it's a loop)
+                if (!fatlabel_fat_is_next(&fs->fat, next) || ++it->steps >= fs->clusters)
+                    return 0;
+                it->cluster = next;
+            }
+            if (fatlabel_src_read(&fs->src, it->buf, fs->cluster_size, fatlabel_fs_cluster_off(fs, it->cluster)))
+                return -1;
+            it->ents = it->buf;
+            it->count = fs->cluster_size / sizeof(struct vfat_dir_entry);
+        }
+        it->index = 0;
+        if (!it->count)
+            return 0;
+    }
+    *ent = &it->ents[it->index++];
+    if ((*ent)->name[0] == 0x00) {
+        it->end = true;
+        return 0;
+    }
+    return 1;
+}
 
-            uint64_t fat_entry_off = (reserved_sct * sct_bytes) + (next_cluster * sizeof(uint32_t));
-            if (pread(fd, &next_cluster, sizeof(next_cluster), fat_entry_off) != sizeof(next_cluster))
-                reterrs("error reading next dirent cluster chain offset: %s", strerror(errno));
+struct fatlabel_dir {
+    struct fatlabel_diriter it;
+    uint16_t lfn[20*13]; // long name being assembled
+    int      lfn_next;   // next expected sequence number (0 if done, -1 if none)
+    uint8_t  lfn_sum;    // checksum of the short name for the long name
+};
 
-            next_cluster &= 0x0fffffff;
+/* fatlabel_lfn_sum computes the checksum of a short name used to check if a
+ * long name belongs to it.
+ */
+static uint8_t fatlabel_lfn_sum(const uint8_t name[11]) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++)
+        sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+    return sum;
+}
 
-            if (next_cluster < 2 || next_cluster > FAT32_MAX)
-                break;
+/* fatlabel_utf8 converts a null-terminated (or full) UTF-16 name to UTF-8. */
+static void fatlabel_utf8(const uint16_t *in, size_t in_n, char *out, size_t out_sz) {
+    size_t o = 0;
+    for (size_t i = 0; i < in_n && in[i]; i++) {
+        uint32_t c = in[i];
+        if (c >= 0xd800 && c < 0xdc00 && i+1 < in_n && in[i+1] >= 0xdc00 && in[i+1] < 0xe000)
+            c = 0x10000 + ((c - 0xd800) << 10) + (in[++i] - 0xdc00);
+        else if (c >= 0xd800 && c < 0xe000)
+            c = '?';
+        char b[4];
+        size_t n = 0;
+        if (c < 0x80) {
+            b[n++] = c;
+        } else if (c < 0x800) {
+            b[n++] = 0xc0 | (c >> 6);
+            b[n++] = 0x80 | (c & 0x3f);
+        } else if (c < 0x10000) {
+            b[n++] = 0xe0 | (c >> 12);
+            b[n++] = 0x80 | ((c >> 6) & 0x3f);
+            b[n++] = 0x80 | (c & 0x3f);
+        } else {
+            b[n++] = 0xf0 | (c >> 18);
+            b[n++] = 0x80 | ((c >> 12) & 0x3f);
+            b[n++] = 0x80 | ((c >> 6) & 0x3f);
+            b[n++] = 0x80 | (c & 0x3f);
+        }
+        if (o + n >= out_sz)
+            break;
+        memcpy(out + o, b, n);
+        o += n;
+    }
+    out[o] = '\0';
+}
 
-            free(ents);
+/* fatlabel_short_name formats an 8.3 name (with the lowercase flags used by
+ * Windows NT).
+ */
+static void fatlabel_short_name(const struct vfat_dir_entry *e, char out[13]) {
+    size_t o = 0;
+    for (int i = 0; i < 8 && e->name[i] != ' '; i++) {
+        char c = i == 0 && e->name[i] == 0x05 ? (char) 0xe5 : e->name[i];
+        out[o++] = (e->time_creat & 0x08) && c >= 'A' && c <= 'Z' ? c + 32 : c;
+    }
+    if (e->name[8] != ' ')
+        out[o++] = '.';
+    for (int i = 8; i < 11 && e->name[i] != ' '; i++) {
+        char c = e->name[i];
+        out[o++] = (e->time_creat & 0x10) && c >= 'A' && c <= 'Z' ? c + 32 : c;
+    }
+    out[o] = '\0';
+}
+
+/* fatlabel_dir_next reads the next entry from a directory, skipping volume
+ * labels, deleted entries, and the dot entries. It returns 1 if there is an
+ * entry, 0 at the end, or -1 on error (errno is set).
+ */
+static int fatlabel_dir_next(struct fatlabel_dir *d, struct fatlabel_dirent *ent) {
+    const struct vfat_dir_entry *e;
+    int r;
+    while ((r = fatlabel_diriter_next(&d->it, &e)) == 1) {
+        const uint8_t *raw = (const uint8_t*) e;
+        if (e->name[0] == FAT_ENTRY_FREE) {
+            d->lfn_next = -1;
+            continue;
         }
-    } else {
-        *boot_label = fatlabel_clean(sb->type.fat.label);
+        if ((e->attr & FAT_ATTR_MASK) == FAT_ATTR_LONG_NAME) {
+            // the long name is stored backwards before the short entry, 13
+            // UTF-16 characters at a time
+            int seq = raw[0] & 0x1f;
+            if (seq < 1 || seq > 20) {
+                d->lfn_next = -1;
+                continue;
+            }
+            if (raw[0] & 0x40) {
+                memset(d->lfn, 0, sizeof(d->lfn));
+                d->lfn_sum = raw[13];
+            } else if (seq != d->lfn_next || raw[13] != d->lfn_sum) {
+                d->lfn_next = -1;
+                continue;
+            }
+            uint16_t *p = &d->lfn[(seq-1)*13];
+            memcpy(p, raw + 1, 10);
+            memcpy(p + 5, raw + 14, 12);
+            memcpy(p + 11, raw + 28, 4);
+            d->lfn_next = seq - 1;
+            continue;
+        }
+        bool lfn = d->lfn_next == 0 && fatlabel_lfn_sum(e->name) == d->lfn_sum;
+        d->lfn_next = -1;
+        if (e->attr & FAT_ATTR_VOLUME_ID)
+            continue;
+        if (e->name[0] == '.' && (e->name[1] == ' ' || (e->name[1] == '.' && e->name[2] == ' ')))
+            continue;
 
-        uint64_t root_off = (reserved_sct + fats_sct) * sct_bytes;
-        struct vfat_dir_entry *ents = (struct vfat_dir_entry*) malloc(dirents * sizeof(struct vfat_dir_entry));
-        if (pread(fd, ents, sizeof(*ents), root_off) != sizeof(*ents))
-            reterrs("error reading root dirents: %s", strerror(errno));
+        fatlabel_short_name(e, ent->short_name);
+        if (lfn)
+            fatlabel_utf8(d->lfn, sizeof(d->lfn)/sizeof(*d->lfn), ent->name, sizeof(ent->name));
+        if (!lfn || !ent->name[0])
+            strcpy(ent->name, ent->short_name);
+        ent->attr = e->attr;
+        ent->cluster = ((uint32_t) e->cluster_high << 16) | e->cluster_low;
+        ent->size = e->size;
+        if (d->it.fs->type != 32)
+            ent->cluster &= 0xffff;
+        return 1;
+    }
+    return r;
+}
 
-        uint8_t *lbl = vfat_dir_entry_get_volume_label(ents, dirents);
-        if (lbl)
-            *volume_label = fatlabel_clean(lbl);
+/* fatlabel_dir_init opens the directory starting at cluster (0 for the root
+ * directory). On error, -1 is returned and errno is set.
+ */
+static int fatlabel_dir_init(struct fatlabel_dir *d, struct fatlabel_fs *fs, uint32_t cluster) {
+    memset(d, 0, sizeof(*d));
+    d->lfn_next = -1;
+    return fatlabel_diriter_init(&d->it, fs, cluster);
+}
 
-        free(ents);
+/* fatlabel_fs_lookup looks up a name in the directory starting at cluster (0
+ * for the root directory), using the dentry cache. On error, -1 is returned and
+ * errno is set.
+ */
+static int fatlabel_fs_lookup(struct fatlabel_fs *fs, uint32_t parent, const char *name, size_t name_n, struct fatlabel_dirent *ent) {
+    uint64_t h = fatlabel_hash(name, name_n, true) ^ parent;
+    struct fatlabel_dcache_ent **b = &fs->dcache[h % FATLABEL_DCACHE_BUCKETS];
+    for (struct fatlabel_dcache_ent *e = *b; e; e = e->next) {
+        if (e->parent == parent && e->hash == h && ((!strncasecmp(e->ent.name, name, name_n) && !e->ent.name[name_n]) || (!strncasecmp(e->ent.short_name, name, name_n) && !e->ent.short_name[name_n]))) {
+            *ent = e->ent;
+            return 0;
+        }
+    }
+
+    struct fatlabel_dir d;
+    if (fatlabel_dir_init(&d, fs, parent))
+        return -1;
+    int r;
+    while ((r = fatlabel_dir_next(&d, ent)) == 1) {
+        if ((!strncasecmp(ent->name, name, name_n) && !ent->name[name_n]) || (!strncasecmp(ent->short_name, name, name_n) && !ent->short_name[name_n]))
+            break;
+    }
+    fatlabel_diriter_free(&d.it);
+    if (r != 1) {
+        if (r == 0)
+            errno = ENOENT;
+        return -1;
     }
 
-    free(sb);
+    struct fatlabel_dcache_ent *e = malloc(sizeof(struct fatlabel_dcache_ent));
+    if (e) {
+        e->parent = parent;
+        e->hash = h;
+        e->ent = *ent;
+        e->next = *b;
+        *b = e;
+    }
     return 0;
-    #undef reterrs
 }
 
-char* fatlabel_search(const char *label) {
-    FILE *f = fopen("/proc/partitions", "r");
+/* fatlabel_fs_info gets the labels, serial, and type of a filesystem. On
+ * error, -1 is returned, errno is set, and the info is only partially filled
+ * in.
+ */
+static int fatlabel_fs_info(struct fatlabel_fs *fs, struct fatlabel_info *info) {
+    const uint8_t *serno = fs->type == 32 ? fs->sb->type.fat32.serno : fs->sb->type.fat.serno;
+    *info = (struct fatlabel_info) {
+        .serno    = serno[0] | (serno[1] << 8) | (serno[2] << 16) | ((uint32_t) serno[3] << 24),
+        .fat_type = fs->type,
+    };
+    fatlabel_clean(fs->type == 32 ? fs->sb->type.fat32.label : fs->sb->type.fat.label, info->boot_label);
 
-    int fd, matches;
-    char buf[1024], dev[1024];
-    char *path, *boot_label, *volume_label, *err;
-    while (fgets(buf, 1024, f)) {
-        if (sscanf(buf, " %*d %*d %*d %[^\n ]", dev) != 1)
-            continue;
+    int r;
+    struct fatlabel_diriter it;
+    const struct vfat_dir_entry *ent;
+    if (!(r = fatlabel_diriter_init(&it, fs, 0))) {
+        while ((r = fatlabel_diriter_next(&it, &ent)) == 1) {
+            uint8_t *lbl = vfat_dir_entry_get_volume_label((struct vfat_dir_entry*) ent, 1);
+            if (lbl) {
+                fatlabel_clean(lbl, info->volume_label);
+                break;
+            }
+        }
+        fatlabel_diriter_free(&it);
+    }
+    return r < 0 ? -1 : 0;
+}
 
-        asprintf(&path, "/dev/%s", dev);
-        if ((fd = open(path, O_RDONLY)) < 0)
-            continue;
+int fatlabel_get(const int fd, char **boot_label, char **volume_label, char **err) {
+    *boot_label = NULL;
+    *volume_label = NULL;
+    *err = NULL;
 
-        // we don't need to handle the error, as the labels will be null if
-        // they don't exist or there is an error (and we don't care for the
-        // error message)
-        fatlabel_get(fd, &boot_label, &volume_label, &err);
+    struct fatlabel_fs fs;
+    struct fatlabel_info info;
+    uint8_t *win = malloc(FATLABEL_WINDOW);
+    if (!win) {
+        asprintf(err, "error allocating window: %s", strerror(errno));
+        return -1;
+    }
+    if (fatlabel_fs_init(&fs, fd, 0, win, FATLABEL_WINDOW, err)) {
+        fatlabel_fs_free(&fs);
+        free(win);
+        return -1;
+    }
 
-        // printf("dev=%s boot=%s vol=%s err=%s\n", path, boot_label, volume_label, err);
-        matches =
-            (boot_label && strcasecmp(label, boot_label) == 0) ||
-            (volume_label && strcasecmp(label, volume_label) == 0);
+    int r = fatlabel_fs_info(&fs, &info);
+    if (r)
+        asprintf(err, "error reading root dirents: %s", strerror(errno));
+    *boot_label = strdup(info.boot_label);
+    if (info.volume_label[0])
+        *volume_label = strdup(info.volume_label);
 
-        free(volume_label);
-        free(boot_label);
-        free(err);
-        close(fd);
+    fatlabel_fs_free(&fs);
+    free(win);
+    return r;
+}
 
-        if (matches) {
-            fclose(f);
-            return path;
+/* fatlabel_probe_dir looks for the volume label in a chunk of the root
+ * directory. It returns true if the label or the end of the directory was
+ * found.
+ */
+static bool fatlabel_probe_dir(const struct vfat_dir_entry *ents, size_t count, struct fatlabel_info *info) {
+    for (; count--; ents++) {
+        if (ents->name[0] == 0x00)
+            return true;
+        uint8_t *lbl = vfat_dir_entry_get_volume_label((struct vfat_dir_entry*) ents, 1);
+        if (lbl) {
+            fatlabel_clean(lbl, info->volume_label);
+            return true;
         }
+    }
+    return false;
+}
+
+/* fatlabel_probe_get returns n bytes at off from the window if they are in it.
+ * Otherwise, they are read into buf, which is at the end of the window (the
+ * window is shrunk first so it doesn't cover buf anymore). On error, NULL is
+ * returned and errno is set.
+ */
+static const void* fatlabel_probe_get(struct fatlabel_src *src, uint8_t *buf, size_t n, uint64_t off) {
+    const void *p = fatlabel_src_ptr(src, n, off);
+    if (p)
+        return p;
+    if (src->win + src->win_sz > buf)
+        src->win_sz = buf - src->win;
+    return fatlabel_src_read(src, buf, n, off) ? NULL : buf;
+}
 
-        free(path);
+/* fatlabel_probe_sb is fatlabel_probe_at for when the window has already been
+ * read, and has at least FATLABEL_PROBE_MIN bytes.
+ */
+static int fatlabel_probe_sb(struct fatlabel_src *src, struct fatlabel_info *info) {
+    struct fatlabel_geom g;
+    char msg[128];
+
+    *info = (struct fatlabel_info) {.fat_type = 0};
+    const struct vfat_super_block *sb = (const struct vfat_super_block*) src->win;
+    if (fatlabel_geom_init(&g, sb, msg, sizeof(msg))) {
+        errno = EINVAL;
+        return -1;
     }
+    const uint8_t *serno = g.type == 32 ? sb->type.fat32.serno : sb->type.fat.serno;
+    info->serno = serno[0] | (serno[1] << 8) | (serno[2] << 16) | ((uint32_t) serno[3] << 24);
+    info->fat_type = g.type;
+    fatlabel_clean(g.type == 32 ? sb->type.fat32.label : sb->type.fat.label, info->boot_label);
 
-    fclose(f);
-    return NULL;
+    // the root directory and FAT are used straight from the window where
+    // possible, and the window is given up for reading the rest (the
+    // superblock isn't needed anymore), except for the first half on FAT32,
+    // which keeps the start of the FAT for walking the root directory chain
+    size_t chunk = g.type == 32 ? src->win_sz / 2 : src->win_sz;
+    chunk -= chunk % sizeof(struct vfat_dir_entry);
+    uint8_t *buf = src->win + src->win_sz - chunk;
+    const struct vfat_dir_entry *ents;
+    if (g.type != 32) {
+        uint64_t len = (uint64_t) g.root_entries * sizeof(struct vfat_dir_entry);
+        for (uint64_t pos = 0; pos < len; pos += chunk) {
+            size_t n = len - pos < chunk ? len - pos : chunk;
+            if (!(ents = fatlabel_probe_get(src, buf, n, g.root_off + pos)))
+                return -1;
+            if (fatlabel_probe_dir(ents, n / sizeof(struct vfat_dir_entry), info))
+                return 0;
+        }
+        return 0;
+    }
+
+    uint32_t c = g.root_cluster;
+    for (uint32_t steps = 0; c >= 2 && c < g.clusters + 2 && steps < g.clusters; steps++) {
+        uint64_t coff = g.data_off + (uint64_t) (c - 2) * g.cluster_size;
+        for (uint32_t pos = 0; pos < g.cluster_size; pos += chunk) {
+            size_t n = g.cluster_size - pos < chunk ? g.cluster_size - pos : chunk;
+            if (!(ents = fatlabel_probe_get(src, buf, n, coff + pos)))
+                return -1;
+            if (fatlabel_probe_dir(ents, n / sizeof(struct vfat_dir_entry), info))
+                return 0;
+        }
+        uint32_t next;
+        if (fatlabel_src_read(src, &next, sizeof(next), g.fat_off + (uint64_t) c * 4))
+            return -1;
+        c = next & 0x0FFFFFFF;
+    }
+    return 0;
+}
+
+/* fatlabel_probe_at is fatlabel_probe for a filesystem at off in fd. */
+static int fatlabel_probe_at(int fd, uint64_t off, struct fatlabel_info *info, void *scratch, size_t scratch_sz) {
+    struct fatlabel_src src;
+    *info = (struct fatlabel_info) {.fat_type = 0};
+    if (scratch_sz < FATLABEL_PROBE_MIN) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fatlabel_src_init(&src, fd, off, scratch, scratch_sz))
+        return -1;
+    if (src.win_sz < FATLABEL_PROBE_MIN) {
+        errno = EIO;
+        return -1;
+    }
+    return fatlabel_probe_sb(&src, info);
+}
+
+int fatlabel_probe(int fd, struct fatlabel_info *info, void *scratch, size_t scratch_sz) {
+    return fatlabel_probe_at(fd, 0, info, scratch, scratch_sz);
+}
+
+/* fatlabel_src_get returns a pointer to n bytes at off, either in the window,
+ * or read into tmp. On error, NULL is returned and errno is set.
+ */
+static const uint8_t* fatlabel_src_get(struct fatlabel_src *src, void *tmp, size_t n, uint64_t off) {
+    const uint8_t *p = fatlabel_src_ptr(src, n, off);
+    if (p)
+        return p;
+    return fatlabel_src_read(src, tmp, n, off) ? NULL : tmp;
+}
+
+/* fatlabel_le reads a little-endian integer of n bytes. */
+static uint64_t fatlabel_le(const uint8_t *p, int n) {
+    uint64_t v = 0;
+    while (n--)
+        v = (v << 8) | p[n];
+    return v;
+}
+
+/* fatlabel_trim copies a space-padded string, removing the padding. */
+static void fatlabel_trim(const uint8_t *in, size_t n, char *out, size_t out_sz) {
+    while (n && (in[n-1] == ' ' || in[n-1] == '\0'))
+        n--;
+    if (n >= out_sz)
+        n = out_sz - 1;
+    memcpy(out, in, n);
+    out[n] = '\0';
+}
+
+/* fatlabel_prober checks for a filesystem signature in the window (reading
+ * more as needed), and fills in the type, label, and UUID. It returns 1 if
+ * the filesystem was recognized, 0 if not, or -1 on error (errno is set).
+ */
+struct fatlabel_prober {
+    int (*probe)(struct fatlabel_src *src, struct fatlabel_fsinfo *info);
+};
+
+static int fatlabel_probe_ext(struct fatlabel_src *src, struct fatlabel_fsinfo *info) {
+    uint8_t tmp[256];
+    const uint8_t *sb = fatlabel_src_get(src, tmp, sizeof(tmp), 1024);
+    if (!sb)
+        return errno == EIO ? 0 : -1;
+    if (fatlabel_le(sb + 0x38, 2) != 0xEF53)
+        return 0;
+
+    uint32_t compat = fatlabel_le(sb + 0x5C, 4), incompat = fatlabel_le(sb + 0x60, 4);
+    if (incompat & (0x0040 | 0x0080 | 0x0200)) // extents, 64bit, flex_bg
+        info->type = "ext4";
+    else if (compat & 0x0004) // has_journal
+        info->type = "ext3";
+    else
+        info->type = "ext2";
+
+    const uint8_t *u = sb + 0x68;
+    fatlabel_trim(sb + 0x78, 16, info->label, sizeof(info->label));
+    snprintf(info->uuid, sizeof(info->uuid), "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+        u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+    return 1;
+}
+
+static int fatlabel_probe_iso9660(struct fatlabel_src *src, struct fatlabel_fsinfo *info) {
+    uint8_t tmp[2048];
+    const uint8_t *pvd = fatlabel_src_get(src, tmp, sizeof(tmp), 32768);
+    if (!pvd)
+        return errno == EIO ? 0 : -1;
+    if (pvd[0] != 0x01 || memcmp(pvd + 1, "CD001", 5))
+        return 0;
+
+    info->type = "iso9660";
+    fatlabel_trim(pvd + 40, 32, info->label, sizeof(info->label));
+
+    // blkid uses the creation time
+    const uint8_t *t = pvd + 813;
+    bool set = false;
+    for (int i = 0; i < 16; i++)
+        set |= t[i] != '0' && t[i] != '\0';
+    if (set)
+        snprintf(info->uuid, sizeof(info->uuid), "%.4s-%.2s-%.2s-%.2s-%.2s-%.2s-%.2s", t, t + 4, t + 6, t + 8, t + 10, t + 12, t + 14);
+    return 1;
+}
+
+static int fatlabel_probe_exfat(struct fatlabel_src *src, struct fatlabel_fsinfo *info) {
+    uint8_t tmp[512];
+    const uint8_t *bs = fatlabel_src_get(src, tmp, sizeof(tmp), 0);
+    if (!bs)
+        return errno == EIO ? 0 : -1;
+    if (memcmp(bs + 3, "EXFAT   ", 8))
+        return 0;
+
+    uint32_t serno = fatlabel_le(bs + 100, 4);
+    info->type = "exfat";
+    snprintf(info->uuid, sizeof(info->uuid), "%04X-%04X", serno >> 16, serno & 0xFFFF);
+
+    uint8_t sect_shift = bs[108], clus_shift = bs[109];
+    if (sect_shift < 9 || sect_shift > 12 || sect_shift + clus_shift > 25)
+        return 1; // the label is optional anyway
+    uint64_t sect = 1ULL << sect_shift, csize = sect << clus_shift;
+    uint64_t fat_off = fatlabel_le(bs + 80, 4) * sect, heap_off = fatlabel_le(bs + 88, 4) * sect;
+    uint32_t clusters = fatlabel_le(bs + 92, 4), c = fatlabel_le(bs + 96, 4);
+
+    // look for the label entry in the root directory
+    uint8_t ents[512];
+    for (uint32_t steps = 0; c >= 2 && c < clusters + 2 && steps < clusters; steps++) {
+        for (uint64_t pos = 0; pos < csize; pos += sizeof(ents)) {
+            if (fatlabel_src_read(src, ents, sizeof(ents), heap_off + (c - 2) * csize + pos))
+                return 1;
+            for (const uint8_t *e = ents; e < ents + sizeof(ents); e += 32) {
+                if (e[0] == 0x00)
+                    return 1;
+                if (e[0] == 0x83) {
+                    uint16_t name[11];
+                    int n = e[1] > 11 ? 11 : e[1];
+                    for (int i = 0; i < n; i++)
+                        name[i] = fatlabel_le(e + 2 + i*2, 2);
+                    fatlabel_utf8(name, n, info->label, sizeof(info->label));
+                    return 1;
+                }
+            }
+        }
+        uint8_t next[4];
+        if (fatlabel_src_read(src, next, 4, fat_off + (uint64_t) c * 4))
+            return 1;
+        c = fatlabel_le(next, 4);
+    }
+    return 1;
+}
+
+static int fatlabel_probe_ntfs(struct fatlabel_src *src, struct fatlabel_fsinfo *info) {
+    uint8_t tmp[512];
+    const uint8_t *bs = fatlabel_src_get(src, tmp, sizeof(tmp), 0);
+    if (!bs)
+        return errno == EIO ? 0 : -1;
+    if (memcmp(bs + 3, "NTFS    ", 8))
+        return 0;
+
+    info->type = "ntfs";
+    snprintf(info->uuid, sizeof(info->uuid), "%016llX", (unsigned long long) fatlabel_le(bs + 0x48, 8));
+
+    // the label is the $VOLUME_NAME attribute of $Volume (MFT record 3)
+    uint32_t sect = fatlabel_le(bs + 0x0B, 2);
+    uint8_t spc = bs[0x0D];
+    int8_t rec = bs[0x40];
+    if (sect < 256 || sect > 4096)
+        return 1;
+    if ((spc > 0x80 && 256 - spc > 31) || rec < -12)
+        return 1; // too big to be valid (and shifting by that much is undefined)
+    uint64_t csize = spc > 0x80 ? 1ULL << (256 - spc) : (uint64_t) spc * sect;
+    uint64_t rsize = rec < 0 ? 1ULL << -rec : (uint64_t) rec * csize;
+    if (!csize || rsize < 512 || rsize > 4096)
+        return 1;
+
+    uint8_t r[4096];
+    if (fatlabel_src_read(src, r, rsize, fatlabel_le(bs + 0x30, 8) * csize + 3 * rsize) || memcmp(r, "FILE", 4))
+        return 1;
+
+    // undo the fixups at the end of each sector
+    uint32_t usa = fatlabel_le(r + 4, 2), usa_n = fatlabel_le(r + 6, 2);
+    if (!usa_n || usa + usa_n * 2 > rsize || usa_n - 1 > rsize / 512)
+        return 1;
+    for (uint32_t i = 1; i < usa_n; i++) {
+        uint8_t *end = r + i * 512 - 2;
+        if (memcmp(end, r + usa, 2))
+            return 1;
+        memcpy(end, r + usa + i*2, 2);
+    }
+
+    for (uint32_t a = fatlabel_le(r + 0x14, 2); a + 24 <= rsize;) {
+        uint32_t type = fatlabel_le(r + a, 4), len = fatlabel_le(r + a + 4, 4);
+        if (type == 0xFFFFFFFF || len < 24 || len > rsize - a)
+            break;
+        if (type == 0x60 && !r[a + 8]) {
+            uint32_t vlen = fatlabel_le(r + a + 0x10, 4), voff = fatlabel_le(r + a + 0x14, 2);
+            if (vlen <= len && voff <= len - vlen) {
+                uint16_t name[128];
+                size_t n = vlen / 2 > 128 ? 128 : vlen / 2;
+                for (size_t i = 0; i < n; i++)
+                    name[i] = fatlabel_le(r + a + voff + i*2, 2);
+                fatlabel_utf8(name, n, info->label, sizeof(info->label));
+            }
+            break;
+        }
+        a += len;
+    }
+    return 1;
+}
+
+static int fatlabel_probe_vfat(struct fatlabel_src *src, struct fatlabel_fsinfo *info) {
+    // the window is reused for reading the root directory, so this needs to be
+    // the last check
+    if (src->win_sz < FATLABEL_PROBE_MIN)
+        return 0;
+    if (fatlabel_probe_sb(src, &info->fat) && !info->fat.fat_type)
+        return errno == EINVAL || errno == EIO ? 0 : -1;
+    info->type = "vfat";
+    snprintf(info->uuid, sizeof(info->uuid), "%04X-%04X", info->fat.serno >> 16, info->fat.serno & 0xFFFF);
+    if (info->fat.volume_label[0])
+        strcpy(info->label, info->fat.volume_label);
+    else if (strcmp(info->fat.boot_label, "NO NAME"))
+        strcpy(info->label, info->fat.boot_label);
+    return 1;
+}
+
+/* fatlabel_probers are tried in order, with the weakest signatures last. */
+static const struct fatlabel_prober fatlabel_probers[] = {
+    {fatlabel_probe_ext},
+    {fatlabel_probe_iso9660},
+    {fatlabel_probe_exfat},
+    {fatlabel_probe_ntfs},
+    {fatlabel_probe_vfat},
+};
+
+int fatlabel_probe_any(int fd, struct fatlabel_fsinfo *info, void *scratch, size_t scratch_sz) {
+    struct fatlabel_src src;
+    *info = (struct fatlabel_fsinfo) {.type = NULL};
+    if (fatlabel_src_init(&src, fd, 0, scratch, scratch_sz))
+        return -1;
+    for (size_t i = 0; i < sizeof(fatlabel_probers)/sizeof(*fatlabel_probers); i++) {
+        int r = fatlabel_probers[i].probe(&src, info);
+        if (r > 0)
+            return 0;
+        if (r < 0)
+            return -1;
+        *info = (struct fatlabel_fsinfo) {.type = NULL};
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+fatlabel_fs_t* fatlabel_open(int fd, char **err) {
+    return fatlabel_open_at(fd, 0, err);
+}
+
+fatlabel_fs_t* fatlabel_open_at(int fd, uint64_t off, char **err) {
+    *err = NULL;
+    fatlabel_fs_t *fs = malloc(sizeof(fatlabel_fs_t));
+    uint8_t *win = malloc(FATLABEL_WINDOW);
+    if (!fs || !win) {
+        asprintf(err, "error allocating filesystem: %s", strerror(errno));
+        free(fs);
+        free(win);
+        return NULL;
+    }
+    if (fatlabel_fs_init(fs, fd, off, win, FATLABEL_WINDOW, err)) {
+        fatlabel_fs_free(fs);
+        free(fs);
+        free(win);
+        return NULL;
+    }
+    return fs;
+}
+
+void fatlabel_close(fatlabel_fs_t *fs) {
+    fatlabel_fs_free(fs);
+    free(fs->win);
+    free(fs);
+}
+
+int fatlabel_lookup(fatlabel_fs_t *fs, const char *path, struct fatlabel_dirent *ent) {
+    *ent = (struct fatlabel_dirent) {
+        .name       = "/",
+        .short_name = "/",
+        .attr       = FAT_ATTR_DIR,
+        .cluster    = 0,
+    };
+    for (const char *c = path, *e; *c; c = e) {
+        for (; *c == '/'; c++);
+        for (e = c; *e && *e != '/'; e++);
+        if (c == e)
+            break;
+        if (!(ent->attr & FAT_ATTR_DIR)) {
+            errno = ENOTDIR;
+            return -1;
+        }
+        if (fatlabel_fs_lookup(fs, ent->cluster, c, e - c, ent))
+            return -1;
+    }
+    return 0;
+}
+
+fatlabel_dir_t* fatlabel_opendir(fatlabel_fs_t *fs, const char *path) {
+    struct fatlabel_dirent ent;
+    if (fatlabel_lookup(fs, path, &ent))
+        return NULL;
+    if (!(ent.attr & FAT_ATTR_DIR)) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+    fatlabel_dir_t *d = malloc(sizeof(fatlabel_dir_t));
+    if (!d)
+        return NULL;
+    if (fatlabel_dir_init(d, fs, ent.cluster)) {
+        int err = errno;
+        free(d);
+        errno = err;
+        return NULL;
+    }
+    return d;
+}
+
+int fatlabel_readdir(fatlabel_dir_t *d, struct fatlabel_dirent *ent) {
+    return fatlabel_dir_next(d, ent);
+}
+
+void fatlabel_closedir(fatlabel_dir_t *d) {
+    fatlabel_diriter_free(&d->it);
+    free(d);
+}
+
+ssize_t fatlabel_pread(fatlabel_fs_t *fs, const struct fatlabel_dirent *ent, void *buf, size_t n, uint64_t off) {
+    if (ent->attr & FAT_ATTR_DIR) {
+        errno = EISDIR;
+        return -1;
+    }
+    if (off >= ent->size)
+        return 0;
+    if (n > ent->size - off)
+        n = ent->size - off;
+
+    size_t r = 0;
+    while (r < n) {
+        uint32_t cluster;
+        if (fatlabel_fs_seek(fs, ent->cluster, (off + r) / fs->cluster_size, &cluster))
+            return -1;
+        uint64_t coff = (off + r) % fs->cluster_size;
+        size_t x = fs->cluster_size - coff < n - r ? fs->cluster_size - coff : n - r;
+        if (fatlabel_src_read(&fs->src, (uint8_t*) buf + r, x, fatlabel_fs_cluster_off(fs, cluster) + coff))
+            return -1;
+        r += x;
+    }
+    return r;
+}
+
+int fatlabel_extents(fatlabel_fs_t *fs, const struct fatlabel_dirent *ent, struct fatlabel_extent **extents, size_t *n) {
+    bool dir = ent->attr & FAT_ATTR_DIR;
+    uint32_t need = (ent->size + fs->cluster_size - 1) / fs->cluster_size;
+    size_t alloc = 4;
+
+    *n = 0;
+    if (!(*extents = malloc(alloc * sizeof(struct fatlabel_extent))))
+        return -1;
+    if (dir && ent->cluster == 0 && fs->type != 32) {
+        // FAT12/16 root directory
+        (*extents)[(*n)++] = (struct fatlabel_extent) {0, fs->src.base + fs->root_off, fs->root_entries * sizeof(struct vfat_dir_entry)};
+        return 0;
+    }
+
+    uint32_t cluster = dir && ent->cluster == 0 ? fs->root_cluster : ent->cluster;
+    for (uint32_t i = 0; dir ? i < fs->clusters : i < need; i++) {
+        if (!fatlabel_fat_is_next(&fs->fat, cluster)) {
+            if (dir && i)
+                break;
+            free(*extents);
+            *extents = NULL;
+            *n = 0;
+            errno = EIO;
+            return -1;
+        }
+
+        uint64_t len = fs->cluster_size;
+        if (!dir && (uint64_t) (i + 1) * fs->cluster_size > ent->size)
+            len = ent->size - (uint64_t) i * fs->cluster_size;
+
+        struct fatlabel_extent *last = *n ? &(*extents)[*n - 1] : NULL;
+        uint64_t off = fs->src.base + fatlabel_fs_cluster_off(fs, cluster);
+        if (last && last->dev_off + last->len == off) {
+            last->len += len;
+        } else {
+            if (*n == alloc) {
+                struct fatlabel_extent *tmp = realloc(*extents, (alloc *= 2) * sizeof(struct fatlabel_extent));
+                if (!tmp) {
+                    free(*extents);
+                    *extents = NULL;
+                    *n = 0;
+                    errno = ENOMEM;
+                    return -1;
+                }
+                *extents = tmp;
+            }
+            (*extents)[(*n)++] = (struct fatlabel_extent) {(uint64_t) i * fs->cluster_size, off, len};
+        }
+
+        if (i + 1 < need || dir) {
+            if (fatlabel_fat_get(&fs->fat, cluster, &cluster)) {
+                int err = errno;
+                free(*extents);
+                *extents = NULL;
+                *n = 0;
+                errno = err;
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+ssize_t fatlabel_copy(fatlabel_fs_t *fs, const struct fatlabel_dirent *ent, int out_fd) {
+    struct fatlabel_extent *ex;
+    size_t n;
+    if (ent->attr & FAT_ATTR_DIR) {
+        errno = EISDIR;
+        return -1;
+    }
+    if (fatlabel_extents(fs, ent, &ex, &n))
+        return -1;
+
+    ssize_t total = 0;
+    bool cfr = true, sf = true;
+    char *buf = NULL;
+    for (size_t i = 0; i < n; i++) {
+        loff_t off = ex[i].dev_off;
+        for (uint64_t rem = ex[i].len; rem;) {
+            ssize_t r = -1;
+            size_t chunk = rem < 0x40000000 ? rem : 0x40000000;
+            if (cfr && (r = copy_file_range(fs->src.fd, &off, out_fd, NULL, chunk, 0)) < 0) {
+                if (errno != EINVAL && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP)
+                    goto fail;
+                cfr = false;
+            }
+            if (r < 0 && sf && (r = sendfile(out_fd, fs->src.fd, &off, chunk)) < 0) {
+                if (errno != EINVAL && errno != ENOSYS)
+                    goto fail;
+                sf = false;
+            }
+            if (r < 0) {
+                // fall back to reading and writing it ourselves
+                if (!buf && !(buf = malloc(FATLABEL_WINDOW)))
+                    goto fail;
+                size_t x = chunk < FATLABEL_WINDOW ? chunk : FATLABEL_WINDOW;
+                if (fatlabel_src_read(&fs->src, buf, x, off - fs->src.base))
+                    goto fail;
+                for (size_t w = 0; w < x;) {
+                    ssize_t y = write(out_fd, buf + w, x - w);
+                    if (y < 0 && errno == EINTR)
+                        continue;
+                    if (y < 0)
+                        goto fail;
+                    w += y;
+                }
+                off += x;
+                r = x;
+            }
+            if (r == 0) {
+                errno = EIO;
+                goto fail;
+            }
+            rem -= r;
+            total += r;
+        }
+    }
+
+    free(buf);
+    free(ex);
+    return total;
+
+fail:;
+    int err = errno;
+    free(buf);
+    free(ex);
+    errno = err;
+    return -1;
+}
+
+/* fatlabel_count_* add the number of free and bad entries in n bytes of a
+ * FAT16 or FAT32 table (n must be a multiple of the entry size) to free_n
+ * and bad_n. FAT12 is handled separately, since the entries are packed, and the
+ * table is at most 6 KiB anyway.
+ */
+static void fatlabel_count_scalar(const uint8_t *p, size_t n, int type, uint64_t *free_n, uint64_t *bad_n) {
+    // a lane is zero if adding all ones below the top bit doesn't carry into
+    // it (and the top bit wasn't already set)
+    size_t i = 0;
+    uint64_t w, b;
+    if (type == 16) {
+        const uint64_t lo = 0x7FFF7FFF7FFF7FFFULL, bv = 0xFFF7FFF7FFF7FFF7ULL;
+        for (; i + 8 <= n; i += 8) {
+            memcpy(&w, p + i, 8);
+            b = w ^ bv;
+            *free_n += __builtin_popcountll(~(((w & lo) + lo) | w) & ~lo);
+            *bad_n += __builtin_popcountll(~(((b & lo) + lo) | b) & ~lo);
+        }
+        for (; i + 2 <= n; i += 2) {
+            uint16_t e = p[i] | (p[i+1] << 8);
+            *free_n += e == 0;
+            *bad_n += e == 0xFFF7;
+        }
+    } else {
+        // the top 4 bits are reserved, so the lanes can't carry after masking
+        const uint64_t m = 0x0FFFFFFF0FFFFFFFULL, lo = 0x7FFFFFFF7FFFFFFFULL, bv = 0x0FFFFFF70FFFFFF7ULL;
+        for (; i + 8 <= n; i += 8) {
+            memcpy(&w, p + i, 8);
+            w &= m;
+            b = w ^ bv;
+            *free_n += __builtin_popcountll(~(w + lo) & ~lo);
+            *bad_n += __builtin_popcountll(~(b + lo) & ~lo);
+        }
+        for (; i + 4 <= n; i += 4) {
+            uint32_t e = (p[i] | (p[i+1] << 8) | (p[i+2] << 16) | ((uint32_t) p[i+3] << 24)) & 0x0FFFFFFF;
+            *free_n += e == 0;
+            *bad_n += e == 0x0FFFFFF7;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2,popcnt")))
+static void fatlabel_count_sse2(const uint8_t *p, size_t n, int type, uint64_t *free_n, uint64_t *bad_n) {
+    size_t i = 0;
+    const __m128i z = _mm_setzero_si128();
+    if (type == 16) {
+        const __m128i bv = _mm_set1_epi16((short) 0xFFF7);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+            *free_n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi16(v, z))) / 2;
+            *bad_n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi16(v, bv))) / 2;
+        }
+    } else {
+        const __m128i m = _mm_set1_epi32(0x0FFFFFFF), bv = _mm_set1_epi32(0x0FFFFFF7);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*) (p + i)), m);
+            *free_n += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, z))));
+            *bad_n += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, bv))));
+        }
+    }
+    fatlabel_count_scalar(p + i, n - i, type, free_n, bad_n);
+}
+
+__attribute__((target("avx2,popcnt")))
+static void fatlabel_count_avx2(const uint8_t *p, size_t n, int type, uint64_t *free_n, uint64_t *bad_n) {
+    size_t i = 0;
+    const __m256i z = _mm256_setzero_si256();
+    if (type == 16) {
+        const __m256i bv = _mm256_set1_epi16((short) 0xFFF7);
+        for (; i + 64 <= n; i += 64) {
+            __m256i v0 = _mm256_loadu_si256((const __m256i*) (p + i));
+            __m256i v1 = _mm256_loadu_si256((const __m256i*) (p + i + 32));
+            // pack the 16-bit comparisons down to bytes so one movemask covers
+            // 32 entries (the lane order doesn't matter for counting)
+            *free_n += __builtin_popcount(_mm256_movemask_epi8(_mm256_packs_epi16(_mm256_cmpeq_epi16(v0, z), _mm256_cmpeq_epi16(v1, z))));
+            *bad_n += __builtin_popcount(_mm256_movemask_epi8(_mm256_packs_epi16(_mm256_cmpeq_epi16(v0, bv), _mm256_cmpeq_epi16(v1, bv))));
+        }
+    } else {
+        const __m256i m = _mm256_set1_epi32(0x0FFFFFFF), bv = _mm256_set1_epi32(0x0FFFFFF7);
+        for (; i + 32 <= n; i += 32) {
+            __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*) (p + i)), m);
+            *free_n += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, z))));
+            *bad_n += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, bv))));
+        }
+    }
+    fatlabel_count_scalar(p + i, n - i, type, free_n, bad_n);
+}
+#elif defined(__ARM_NEON)
+static void fatlabel_count_neon(const uint8_t *p, size_t n, int type, uint64_t *free_n, uint64_t *bad_n) {
+    size_t i = 0;
+    if (type == 16) {
+        const uint16x8_t z = vdupq_n_u16(0), bv = vdupq_n_u16(0xFFF7);
+        for (; i + 16 <= n; i += 16) {
+            uint16x8_t v = vld1q_u16((const uint16_t*) (p + i));
+            uint64x2_t f = vpaddlq_u32(vpaddlq_u16(vshrq_n_u16(vceqq_u16(v, z), 15)));
+            uint64x2_t b = vpaddlq_u32(vpaddlq_u16(vshrq_n_u16(vceqq_u16(v, bv), 15)));
+            *free_n += vgetq_lane_u64(f, 0) + vgetq_lane_u64(f, 1);
+            *bad_n += vgetq_lane_u64(b, 0) + vgetq_lane_u64(b, 1);
+        }
+    } else {
+        const uint32x4_t m = vdupq_n_u32(0x0FFFFFFF), z = vdupq_n_u32(0), bv = vdupq_n_u32(0x0FFFFFF7);
+        for (; i + 16 <= n; i += 16) {
+            uint32x4_t v = vandq_u32(vld1q_u32((const uint32_t*) (p + i)), m);
+            uint64x2_t f = vpaddlq_u32(vshrq_n_u32(vceqq_u32(v, z), 31));
+            uint64x2_t b = vpaddlq_u32(vshrq_n_u32(vceqq_u32(v, bv), 31));
+            *free_n += vgetq_lane_u64(f, 0) + vgetq_lane_u64(f, 1);
+            *bad_n += vgetq_lane_u64(b, 0) + vgetq_lane_u64(b, 1);
+        }
+    }
+    fatlabel_count_scalar(p + i, n - i, type, free_n, bad_n);
+}
+#endif
+
+static void fatlabel_count_resolve(const uint8_t *p, size_t n, int type, uint64_t *free_n, uint64_t *bad_n);
+static void (*fatlabel_count)(const uint8_t *p, size_t n, int type, uint64_t *free_n, uint64_t *bad_n) = fatlabel_count_resolve;
+
+static void fatlabel_count_resolve(const uint8_t *p, size_t n, int type, uint64_t *free_n, uint64_t *bad_n) {
+    void (*fn)(const uint8_t*, size_t, int, uint64_t*, uint64_t*) = fatlabel_count_scalar;
+    #if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        fn = fatlabel_count_avx2;
+    else if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt"))
+        fn = fatlabel_count_sse2;
+    #elif defined(__ARM_NEON)
+    fn = fatlabel_count_neon;
+    #endif
+    // every thread resolves to the same function, so the race is harmless
+    __atomic_store_n(&fatlabel_count, fn, __ATOMIC_RELAXED);
+    fn(p, n, type, free_n, bad_n);
+}
+
+int fatlabel_stat(int fd, struct fatlabel_stat *st, bool use_fsinfo) {
+    struct fatlabel_src src = {.fd = fd};
+    struct fatlabel_geom g;
+    uint8_t bs[FATLABEL_PROBE_MIN];
+    char msg[128];
+
+    if (fatlabel_src_read(&src, bs, sizeof(bs), 0))
+        return -1;
+    const struct vfat_super_block *sb = (const void*) bs;
+    if (fatlabel_geom_init(&g, sb, msg, sizeof(msg))) {
+        errno = EINVAL;
+        return -1;
+    }
+    *st = (struct fatlabel_stat) {
+        .cluster_size = g.cluster_size,
+        .clusters     = g.clusters,
+    };
+
+    uint16_t fsinfo = sb->type.fat32.insfo_sector;
+    if (use_fsinfo && g.type == 32 && fsinfo && fsinfo != 0xFFFF) {
+        uint8_t fsi[512];
+        uint32_t sig1, sig2, sig3, free_count;
+        if (!fatlabel_src_read(&src, fsi, sizeof(fsi), (uint64_t) fsinfo * sb->sector_size_bytes)) {
+            memcpy(&sig1, fsi, 4);
+            memcpy(&sig2, fsi + 484, 4);
+            memcpy(&free_count, fsi + 488, 4);
+            memcpy(&sig3, fsi + 508, 4);
+            // the count is 0xFFFFFFFF if unknown
+            if (sig1 == 0x41615252 && sig2 == 0x61417272 && sig3 == 0xAA550000 && free_count <= g.clusters) {
+                st->free = free_count;
+                st->from_fsinfo = true;
+                return 0;
+            }
+        }
+    }
+
+    // the entries for the data clusters (ignoring the first two)
+    int esz = g.type / 8;
+    uint64_t start = g.type == 12 ? 0 : 2 * esz;
+    uint64_t end = g.type == 12 ? ((uint64_t) g.clusters + 2) * 3 / 2 + 1 : ((uint64_t) g.clusters + 2) * esz;
+    if (end > g.fat_len)
+        end = g.fat_len - (g.type == 12 ? 0 : g.fat_len % esz);
+    if (end <= start)
+        return 0;
+
+    size_t chunk = FATLABEL_STAT_CHUNK - FATLABEL_STAT_CHUNK % 4;
+    uint8_t *buf = malloc(g.type == 12 ? end : chunk);
+    if (!buf)
+        return -1;
+    posix_fadvise(fd, g.fat_off + start, end - start, POSIX_FADV_SEQUENTIAL);
+
+    uint64_t free_n = 0, bad_n = 0;
+    for (uint64_t pos = start; pos < end;) {
+        size_t n = g.type == 12 || end - pos < chunk ? end - pos : chunk;
+        if (fatlabel_src_read(&src, buf, n, g.fat_off + pos)) {
+            int err = errno;
+            free(buf);
+            errno = err;
+            return -1;
+        }
+        if (g.type == 12) {
+            for (uint32_t c = 2; c < g.clusters + 2 && (uint64_t) c * 3 / 2 + 1 < n; c++) {
+                const uint8_t *e = buf + c * 3 / 2;
+                uint16_t v = c & 1 ? (e[0] >> 4) | (e[1] << 4) : e[0] | ((e[1] & 0x0F) << 8);
+                free_n += v == 0;
+                bad_n += v == 0xFF7;
+            }
+        } else {
+            fatlabel_count(buf, n, g.type, &free_n, &bad_n);
+        }
+        pos += n;
+    }
+    free(buf);
+
+    st->free = free_n;
+    st->bad = bad_n;
+    return 0;
+}
+
+#define FATLABEL_CHECK_EOC 0xFFFFFFFF // end of chain in the decoded FAT
+#define FATLABEL_CHECK_BAD 0xFFFFFFF7 // bad cluster in the decoded FAT
+
+/* fatlabel_checker is the state shared by the threads of fatlabel_check. The
+ * FAT is decoded into memory first, so it can be read from any thread without
+ * locking, and each cluster is claimed in the ownership bitmap by the first
+ * chain which reaches it.
+ */
+struct fatlabel_checker {
+    struct fatlabel_fs *fs;
+    uint32_t       *next;   // decoded FAT entries
+    uint64_t       *owned;  // one bit per cluster
+    pthread_mutex_t mut;
+    pthread_cond_t  cond;
+    struct fatlabel_check_task *tasks;
+    size_t          busy;   // number of tasks queued or running
+    int             err;    // first error
+    struct fatlabel_check *res;
+    void          (*report)(void *data, const char *msg);
+    void           *data;
+};
+
+struct fatlabel_check_task {
+    struct fatlabel_check_task *next;
+    uint32_t cluster;
+    char     path[];
+};
+
+/* fatlabel_check_problem increments a counter and reports a problem. */
+__attribute__((format(printf, 3, 4)))
+static void fatlabel_check_problem(struct fatlabel_checker *ck, uint32_t *counter, const char *fmt, ...) {
+    char msg[1024];
+    va_list ap;
+    pthread_mutex_lock(&ck->mut);
+    (*counter)++;
+    if (ck->report) {
+        va_start(ap, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        ck->report(ck->data, msg);
+    }
+    pthread_mutex_unlock(&ck->mut);
+}
+
+static void fatlabel_check_error(struct fatlabel_checker *ck, int err) {
+    pthread_mutex_lock(&ck->mut);
+    if (!ck->err)
+        ck->err = err;
+    pthread_mutex_unlock(&ck->mut);
+}
+
+/* fatlabel_check_load decodes the FAT, reading it in chunks of
+ * FATLABEL_STAT_CHUNK bytes. On error, -1 is returned and errno is set.
+ */
+static int fatlabel_check_load(struct fatlabel_checker *ck) {
+    struct fatlabel_fs *fs = ck->fs;
+    uint32_t n = fs->clusters + 2;
+    int esz = fs->type == 12 ? 3 : fs->type / 8; // bytes per entry (or per 2 entries for FAT12)
+    size_t chunk = FATLABEL_STAT_CHUNK - FATLABEL_STAT_CHUNK % 12;
+    uint8_t *buf;
+
+    if (!(ck->next = malloc((size_t) n * sizeof(uint32_t))) || !(buf = malloc(chunk)))
+        return -1;
+
+    uint32_t eoc = fs->type == 12 ? 0xFF8 : fs->type == 16 ? 0xFFF8 : 0x0FFFFFF8;
+    uint32_t bad = eoc - 1;
+    for (uint32_t c = 0; c < n;) {
+        // FAT12 chunks start on an even entry, since chunk is a multiple of 3
+        uint64_t off = fs->type == 12 ? (uint64_t) c * 3 / 2 : (uint64_t) c * esz;
+        uint64_t len = fs->type == 12 ? ((uint64_t) n * 3 + 1) / 2 - off : (uint64_t) (n - c) * esz;
+        if (len > chunk)
+            len = chunk;
+        if (off + len > fs->fat.len)
+            len = off < fs->fat.len ? fs->fat.len - off : 0;
+        if (!len || fatlabel_src_read(&fs->src, buf, len, fs->fat.off + off)) {
+            if (!len)
+                errno = EIO;
+            free(buf);
+            return -1;
+        }
+
+        uint32_t end = fs->type == 12 ? c + len * 2 / 3 : c + len / esz;
+        if (end == c) {
+            free(buf);
+            errno = EIO;
+            return -1;
+        }
+        for (uint32_t i = 0; c < end && c < n; c++, i++) {
+            uint32_t v;
+            const uint8_t *p;
+            switch (fs->type) {
+            case 12:
+                p = buf + i * 3 / 2;
+                v = i & 1 ? (p[0] >> 4) | (p[1] << 4) : p[0] | ((p[1] & 0x0F) << 8);
+                break;
+            case 16:
+                v = buf[i*2] | (buf[i*2+1] << 8);
+                break;
+            default:
+                v = (buf[i*4] | (buf[i*4+1] << 8) | (buf[i*4+2] << 16) | ((uint32_t) buf[i*4+3] << 24)) & 0x0FFFFFFF;
+                break;
+            }
+            ck->next[c] = v >= eoc ? FATLABEL_CHECK_EOC : v == bad ? FATLABEL_CHECK_BAD : v;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+/* fatlabel_check_chain follows and claims a chain, stopping at the first
+ * problem, and returns the number of clusters claimed. If clusters is not
+ * NULL, the claimed clusters are appended to it (it is freed on error).
+ */
+static uint32_t fatlabel_check_chain(struct fatlabel_checker *ck, uint32_t first, const char *path, uint32_t **clusters, bool *ok) {
+    struct fatlabel_fs *fs = ck->fs;
+    uint32_t n = 0, alloc = 0, c = first;
+    *ok = false;
+    while (true) {
+        if (!fatlabel_fat_is_next(&fs->fat, c)) {
+            fatlabel_check_problem(ck, &ck->res->bad_chains, "%s: chain has invalid cluster %u after %u clusters", path, c, n);
+            return n;
+        }
+
+        uint64_t bit = 1ULL << (c & 63);
+        if (__atomic_fetch_or(&ck->owned[c >> 6], bit, __ATOMIC_RELAXED) & bit) {
+            // it's a loop if we've already been here, otherwise another chain
+            // owns it
+            bool loop = false;
+            for (uint32_t i = 0, x = first; i < n && !loop; i++, x = ck->next[x])
+                loop = x == c;
+            if (loop)
+                fatlabel_check_problem(ck, &ck->res->loops, "%s: chain loops back to cluster %u after %u clusters", path, c, n);
+            else
+                fatlabel_check_problem(ck, &ck->res->cross_links, "%s: cluster %u is cross-linked", path, c);
+            return n;
+        }
+
+        if (clusters) {
+            if (n == alloc) {
+                uint32_t *tmp = realloc(*clusters, (alloc = alloc ? alloc * 2 : 16) * sizeof(uint32_t));
+                if (!tmp) {
+                    fatlabel_check_error(ck, errno);
+                    return n;
+                }
+                *clusters = tmp;
+            }
+            (*clusters)[n] = c;
+        }
+        n++;
+
+        uint32_t v = ck->next[c];
+        if (v == FATLABEL_CHECK_EOC) {
+            *ok = true;
+            return n;
+        }
+        if (v == FATLABEL_CHECK_BAD || v == 0) {
+            fatlabel_check_problem(ck, &ck->res->bad_chains, "%s: chain runs into a %s cluster after %u clusters", path, v ? "bad" : "free", n);
+            return n;
+        }
+        c = v;
+    }
+}
+
+static void fatlabel_check_push(struct fatlabel_checker *ck, uint32_t cluster, const char *parent, const char *name) {
+    struct fatlabel_check_task *t = malloc(sizeof(struct fatlabel_check_task) + strlen(parent) + strlen(name) + 2);
+    if (!t) {
+        fatlabel_check_error(ck, errno);
+        return;
+    }
+    t->cluster = cluster;
+    sprintf(t->path, "%s/%s", strcmp(parent, "/") ? parent : "", name);
+
+    pthread_mutex_lock(&ck->mut);
+    t->next = ck->tasks;
+    ck->tasks = t;
+    ck->busy++;
+    pthread_cond_signal(&ck->cond);
+    pthread_mutex_unlock(&ck->mut);
+}
+
+/* fatlabel_check_dir checks the entries of a directory, and queues its
+ * subdirectories.
+ */
+static void fatlabel_check_dir(struct fatlabel_checker *ck, uint32_t cluster, const char *path) {
+    struct fatlabel_fs *fs = ck->fs;
+    uint32_t *clusters = NULL, n = 0;
+    struct vfat_dir_entry *ents = NULL;
+    size_t count;
+    bool ok;
+
+    __atomic_add_fetch(&ck->res->dirs, 1, __ATOMIC_RELAXED);
+    if (cluster == 0 && fs->type != 32) {
+        count = fs->root_entries;
+        if (!(ents = malloc(count * sizeof(struct vfat_dir_entry))) || fatlabel_src_read(&fs->src, ents, count * sizeof(struct vfat_dir_entry), fs->root_off)) {
+            fatlabel_check_error(ck, errno);
+            free(ents);
+            return;
+        }
+    } else {
+        if (!(n = fatlabel_check_chain(ck, cluster ? cluster : fs->root_cluster, path, &clusters, &ok))) {
+            free(clusters);
+            return;
+        }
+        count = (size_t) n * fs->cluster_size / sizeof(struct vfat_dir_entry);
+        if (!(ents = malloc((size_t) n * fs->cluster_size))) {
+            fatlabel_check_error(ck, errno);
+            free(clusters);
+            return;
+        }
+        // read runs of contiguous clusters at once
+        for (uint32_t i = 0, j; i < n; i = j) {
+            for (j = i + 1; j < n && clusters[j] == clusters[j-1] + 1; j++)
+                ;
+            if (fatlabel_src_read(&fs->src, (uint8_t*) ents + (size_t) i * fs->cluster_size, (size_t) (j - i) * fs->cluster_size, fatlabel_fs_cluster_off(fs, clusters[i]))) {
+                fatlabel_check_error(ck, errno);
+                free(clusters);
+                free(ents);
+                return;
+            }
+        }
+        free(clusters);
+    }
+
+    char name[13], sub[PATH_MAX];
+    for (size_t i = 0; i < count && ents[i].name[0]; i++) {
+        const struct vfat_dir_entry *e = &ents[i];
+        if (e->name[0] == FAT_ENTRY_FREE || (e->attr & FAT_ATTR_MASK) == FAT_ATTR_LONG_NAME || (e->attr & FAT_ATTR_VOLUME_ID))
+            continue;
+        if (e->name[0] == '.' && (e->name[1] == ' ' || (e->name[1] == '.' && e->name[2] == ' ')))
+            continue;
+
+        uint32_t first = e->cluster_low | (fs->type == 32 ? (uint32_t) e->cluster_high << 16 : 0);
+        fatlabel_short_name(e, name);
+        snprintf(sub, sizeof(sub), "%s/%s", strcmp(path, "/") ? path : "", name);
+
+        if (e->attr & FAT_ATTR_DIR) {
+            if (!first)
+                fatlabel_check_problem(ck, &ck->res->bad_chains, "%s: directory has no clusters", sub);
+            else
+                fatlabel_check_push(ck, first, path, name);
+            continue;
+        }
+
+        __atomic_add_fetch(&ck->res->files, 1, __ATOMIC_RELAXED);
+        uint32_t need = (e->size + (uint64_t) fs->cluster_size - 1) / fs->cluster_size;
+        uint32_t len = first ? fatlabel_check_chain(ck, first, sub, NULL, &ok) : 0;
+        if (!first)
+            ok = true;
+        if (ok && len != need)
+            fatlabel_check_problem(ck, &ck->res->size_mismatch, "%s: size is %u bytes (%u clusters), but the chain has %u clusters", sub, e->size, need, len);
+    }
+    free(ents);
+}
+
+static void* fatlabel_check_worker(void *arg) {
+    struct fatlabel_checker *ck = arg;
+    pthread_mutex_lock(&ck->mut);
+    while (true) {
+        while (!ck->tasks && ck->busy)
+            pthread_cond_wait(&ck->cond, &ck->mut);
+        if (!ck->tasks)
+            break;
+        struct fatlabel_check_task *t = ck->tasks;
+        ck->tasks = t->next;
+        pthread_mutex_unlock(&ck->mut);
+
+        fatlabel_check_dir(ck, t->cluster, t->path);
+        free(t);
+
+        pthread_mutex_lock(&ck->mut);
+        if (!--ck->busy)
+            pthread_cond_broadcast(&ck->cond);
+    }
+    pthread_mutex_unlock(&ck->mut);
+    return NULL;
+}
+
+int fatlabel_check(int fd, struct fatlabel_check *res, void (*report)(void *data, const char *msg), void *data) {
+    struct fatlabel_fs fs;
+    struct fatlabel_checker ck = {
+        .fs     = &fs,
+        .res    = res,
+        .report = report,
+        .data   = data,
+    };
+    char *err = NULL;
+    *res = (struct fatlabel_check) {.dirs = 0};
+
+    uint8_t *win = malloc(FATLABEL_WINDOW);
+    if (!win)
+        return -1;
+    if (fatlabel_fs_init(&fs, fd, 0, win, FATLABEL_WINDOW, &err)) {
+        fatlabel_fs_free(&fs);
+        free(win);
+        free(err);
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint32_t n = fs.clusters + 2;
+    if (!(ck.owned = calloc((n + 63) / 64, sizeof(uint64_t))) || fatlabel_check_load(&ck)) {
+        int e = errno;
+        free(ck.owned);
+        free(ck.next);
+        fatlabel_fs_free(&fs);
+        free(win);
+        errno = e;
+        return -1;
+    }
+    pthread_mutex_init(&ck.mut, NULL);
+    pthread_cond_init(&ck.cond, NULL);
+
+    // the calling thread is one of the workers
+    pthread_t threads[FATLABEL_THREADS];
+    size_t threads_n = 0;
+    fatlabel_check_push(&ck, 0, "/", "");
+    while (threads_n + 1 < FATLABEL_THREADS && !pthread_create(&threads[threads_n], NULL, fatlabel_check_worker, &ck))
+        threads_n++;
+    fatlabel_check_worker(&ck);
+    for (size_t i = 0; i < threads_n; i++)
+        pthread_join(threads[i], NULL);
+
+    // anything which is allocated but wasn't claimed is lost, and the ones
+    // which no other lost cluster points to are the starts of lost chains
+    uint64_t *pointed = calloc((n + 63) / 64, sizeof(uint64_t));
+    for (uint32_t c = 2; c < n; c++) {
+        uint32_t v = ck.next[c];
+        if (!v || v == FATLABEL_CHECK_BAD || (ck.owned[c >> 6] & (1ULL << (c & 63))))
+            continue;
+        res->lost_clusters++;
+        if (pointed && v < n)
+            pointed[v >> 6] |= 1ULL << (v & 63);
+    }
+    for (uint32_t c = 2; c < n && pointed; c++) {
+        uint32_t v = ck.next[c];
+        if (!v || v == FATLABEL_CHECK_BAD || (ck.owned[c >> 6] & (1ULL << (c & 63))) || (pointed[c >> 6] & (1ULL << (c & 63))))
+            continue;
+        res->lost_chains++;
+    }
+    if (res->lost_clusters && !res->lost_chains)
+        res->lost_chains = 1; // only loops
+    if (res->lost_clusters && report) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "%u lost clusters in %u chains", res->lost_clusters, res->lost_chains);
+        report(data, msg);
+    }
+    free(pointed);
+
+    int e = ck.err;
+    pthread_mutex_destroy(&ck.mut);
+    pthread_cond_destroy(&ck.cond);
+    free(ck.owned);
+    free(ck.next);
+    fatlabel_fs_free(&fs);
+    free(win);
+    if (e) {
+        errno = e;
+        return -1;
+    }
+    return res->cross_links || res->loops || res->bad_chains || res->size_mismatch || res->lost_chains ? 1 : 0;
+}
+
+#define FATLABEL_PART_MAX    256  // max number of partitions to list
+
+/* fatlabel_part_probe probes a partition for a FAT filesystem, using win
+ * (FATLABEL_WINDOW bytes) for reading.
+ */
+static void fatlabel_part_probe(int fd, struct fatlabel_part *part, uint8_t *win) {
+    fatlabel_probe_at(fd, part->off, &part->info, win, FATLABEL_WINDOW);
+    part->fat = part->info.fat_type != 0;
+}
+
+/* fatlabel_part_add appends a partition, returning false if the list is
+ * full or can't be grown.
+ */
+static bool fatlabel_part_add(struct fatlabel_part **parts, size_t *n, struct fatlabel_part part) {
+    if (*n >= FATLABEL_PART_MAX)
+        return false;
+    if (!*n || (*n >= 4 && !(*n & (*n - 1)))) {
+        struct fatlabel_part *tmp = realloc(*parts, (*n ? *n * 2 : 4) * sizeof(struct fatlabel_part));
+        if (!tmp)
+            return false;
+        *parts = tmp;
+    }
+    (*parts)[(*n)++] = part;
+    return true;
+}
+
+/* fatlabel_part_gpt reads a GPT with the specified sector size. It returns 1
+ * if one was found, 0 if not, or -1 on error (errno is set).
+ */
+static int fatlabel_part_gpt(struct fatlabel_src *src, uint32_t sect, struct fatlabel_part **parts, size_t *n) {
+    uint8_t hdr[92];
+    if (fatlabel_src_read(src, hdr, sizeof(hdr), sect))
+        return errno == EIO ? 0 : -1;
+    if (memcmp(hdr, "EFI PART", 8))
+        return 0;
+
+    uint64_t lba;
+    uint32_t count, size;
+    memcpy(&lba, hdr + 0x48, 8);
+    memcpy(&count, hdr + 0x50, 4);
+    memcpy(&size, hdr + 0x54, 4);
+    if (size < 128 || size > 4096 || count > 1024) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint8_t *ents = malloc((size_t) count * size);
+    if (!ents)
+        return -1;
+    if (fatlabel_src_read(src, ents, (size_t) count * size, lba * sect)) {
+        int err = errno;
+        free(ents);
+        errno = err;
+        return -1;
+    }
+
+    static const uint8_t unused[16];
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *e = ents + (size_t) i * size;
+        uint64_t first, last;
+        memcpy(&first, e + 32, 8);
+        memcpy(&last, e + 40, 8);
+        if (!memcmp(e, unused, 16) || last < first)
+            continue;
+        if (!fatlabel_part_add(parts, n, (struct fatlabel_part) {
+            .index = i + 1,
+            .off   = first * sect,
+            .len   = (last - first + 1) * sect,
+        }))
+            break;
+    }
+    free(ents);
+    return 1;
+}
+
+/* fatlabel_part_mbr reads an MBR and the EBRs of its extended partition. It
+ * returns 1 if one was found, 0 if not, or -1 on error (errno is set).
+ */
+static int fatlabel_part_mbr(struct fatlabel_src *src, const uint8_t mbr[512], struct fatlabel_part **parts, size_t *n) {
+    if (mbr[510] != 0x55 || mbr[511] != 0xAA)
+        return 0;
+
+    // boot sectors without a partition table also end with 55AA, so check
+    // the entries are sane
+    bool any = false;
+    for (int i = 0; i < 4; i++) {
+        const uint8_t *e = mbr + 446 + 16*i;
+        if (e[0] != 0x00 && e[0] != 0x80)
+            return 0;
+        any |= e[4] != 0;
+    }
+    if (!any)
+        return 0;
+
+    uint64_t ext = 0;
+    for (int i = 0; i < 4; i++) {
+        const uint8_t *e = mbr + 446 + 16*i;
+        uint32_t start, len;
+        memcpy(&start, e + 8, 4);
+        memcpy(&len, e + 12, 4);
+        if (!e[4] || !start || !len)
+            continue;
+        if (e[4] == 0x05 || e[4] == 0x0F || e[4] == 0x85) {
+            if (!ext)
+                ext = start;
+            continue;
+        }
+        fatlabel_part_add(parts, n, (struct fatlabel_part) {
+            .index = i + 1,
+            .type  = e[4],
+            .off   = (uint64_t) start * 512,
+            .len   = (uint64_t) len * 512,
+        });
+    }
+
+    // the first entry of each EBR is relative to the EBR, and the second one
+    // links to the next EBR relative to the start of the extended partition
+    uint8_t ebr[512];
+    uint64_t cur = ext;
+    for (int index = 5; cur && index < 5 + FATLABEL_PART_MAX; index++) {
+        if (fatlabel_src_read(src, ebr, 512, cur * 512))
+            return -1;
+        if (ebr[510] != 0x55 || ebr[511] != 0xAA)
+            break;
+
+        uint32_t start, len, next;
+        memcpy(&start, ebr + 446 + 8, 4);
+        memcpy(&len, ebr + 446 + 12, 4);
+        memcpy(&next, ebr + 462 + 8, 4);
+        if (ebr[446 + 4] && start && len && !fatlabel_part_add(parts, n, (struct fatlabel_part) {
+            .index = index,
+            .type  = ebr[446 + 4],
+            .off   = (cur + start) * 512,
+            .len   = (uint64_t) len * 512,
+        }))
+            break;
+        if (!next || ext + next <= cur)
+            break; // no more, or a loop
+        cur = ext + next;
+    }
+    return 1;
+}
+
+int fatlabel_partitions(int fd, struct fatlabel_part **parts, size_t *n) {
+    struct fatlabel_src src;
+    struct fatlabel_part whole = {.index = 0};
+    uint8_t mbr[512];
+    *parts = NULL;
+    *n = 0;
+
+    // the window at the start is shared by the FAT probe of the whole device
+    // and the partition tables (if it isn't FAT, the window is left as-is)
+    uint8_t *win = malloc(FATLABEL_WINDOW);
+    if (!win)
+        return -1;
+    if (fatlabel_src_init(&src, fd, 0, win, FATLABEL_WINDOW)) {
+        int err = errno;
+        free(win);
+        errno = err;
+        return -1;
+    }
+
+    // a FAT filesystem without a partition table (e.g. a floppy image)
+    if (src.win_sz >= FATLABEL_PROBE_MIN)
+        fatlabel_probe_sb(&src, &whole.info);
+    if ((whole.fat = whole.info.fat_type != 0)) {
+        struct stat st;
+        free(win);
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode))
+            whole.len = st.st_size;
+        if (!fatlabel_part_add(parts, n, whole))
+            return -1;
+        return 0;
+    }
+
+    if (fatlabel_src_read(&src, mbr, 512, 0)) {
+        free(win);
+        if (errno == EIO)
+            errno = EINVAL;
+        return -1;
+    }
+
+    // a protective MBR means there's a GPT (with 512 or 4096-byte sectors)
+    int r = 0;
+    if (mbr[450] == 0xEE && mbr[510] == 0x55 && mbr[511] == 0xAA)
+        if (!(r = fatlabel_part_gpt(&src, 512, parts, n)))
+            r = fatlabel_part_gpt(&src, 4096, parts, n);
+    if (!r)
+        r = fatlabel_part_mbr(&src, mbr, parts, n);
+    if (r <= 0) {
+        int err = r ? errno : EINVAL;
+        free(win);
+        free(*parts);
+        *parts = NULL;
+        *n = 0;
+        errno = err;
+        return -1;
+    }
+
+    for (size_t i = 0; i < *n; i++)
+        fatlabel_part_probe(fd, &(*parts)[i], win);
+    free(win);
+    return 0;
+}
+
+struct fatlabel_dev {
+    char     *path;
+    dev_t     dev;
+    uint64_t  size; // bytes
+    int       rank; // devices with a lower rank are probed first
+};
+
+static void fatlabel_devices_free(struct fatlabel_dev *devs, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        free(devs[i].path);
+    free(devs);
+}
+
+/* fatlabel_sysfs reads an attribute of a block device (named as in
+ * /proc/partitions) from sysfs, without the trailing newline. On error, -1 is
+ * returned.
+ */
+static int fatlabel_sysfs(const char *name, const char *attr, char *buf, size_t sz) {
+    char path[PATH_MAX];
+    int l = snprintf(path, sizeof(path), "/sys/class/block/%s/%s", name, attr);
+    if (l < 0 || (size_t) l >= sizeof(path))
+        return -1;
+    for (char *c = path + strlen("/sys/class/block/"); c < path + l - strlen(attr) - 1; c++)
+        if (*c == '/')
+            *c = '!'; // e.g. cciss/c0d0
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t r = read(fd, buf, sz - 1);
+    close(fd);
+    if (r < 0)
+        return -1;
+    while (r && buf[r - 1] == '\n')
+        r--;
+    buf[r] = '\0';
+    return 0;
+}
+
+/* fatlabel_sysfs_parent gets the name of the disk containing a partition. On
+ * error (or if it isn't a partition), -1 is returned.
+ */
+static int fatlabel_sysfs_parent(const char *name, char *buf, size_t sz) {
+    char tmp[32], path[PATH_MAX], real[PATH_MAX];
+    if (fatlabel_sysfs(name, "partition", tmp, sizeof(tmp)))
+        return -1;
+    int l = snprintf(path, sizeof(path), "/sys/class/block/%s/..", name);
+    if (l < 0 || (size_t) l >= sizeof(path) || !realpath(path, real))
+        return -1;
+    const char *base = strrchr(real, '/');
+    if (!base || strlen(base + 1) >= sz)
+        return -1;
+    strcpy(buf, base + 1);
+    for (char *c = buf; *c; c++)
+        if (*c == '!')
+            *c = '/';
+    return 0;
+}
+
+/* fatlabel_devices lists the devices in /proc/partitions which could contain a
+ * filesystem. Empty or tiny devices (e.g. card readers without a card, or
+ * extended partitions), RAM disks, and disks which are partitioned are skipped,
+ * since there's no point opening them. The returned array must be freed with
+ * fatlabel_devices_free. On error, -1 is returned and errno is set.
+ */
+static int fatlabel_devices(struct fatlabel_dev **devs, size_t *n) {
+    FILE *f = fopen("/proc/partitions", "r");
+    if (!f)
+        return -1;
+
+    char buf[1024], dev[1024], parent[256];
+    unsigned int major, minor;
+    unsigned long long blocks;
+    size_t alloc = 16, parents_n = 0;
+    char **parents = NULL;
+    *n = 0;
+    if (!(*devs = malloc(alloc * sizeof(struct fatlabel_dev))))
+        goto fail;
+    while (fgets(buf, 1024, f)) {
+        if (sscanf(buf, " %u %u %llu %[^\n ]", &major, &minor, &blocks, dev) != 4)
+            continue;
+        if (!strncmp(dev, "ram", 3) || !strncmp(dev, "zram", 4))
+            continue;
+
+        // sysfs has the size in 512-byte sectors regardless of the block size
+        uint64_t size = blocks * 1024;
+        if (!fatlabel_sysfs(dev, "size", buf, sizeof(buf)))
+            size = strtoull(buf, NULL, 10) * 512;
+        if (size < FATLABEL_MIN_SIZE)
+            continue;
+
+        if (!fatlabel_sysfs_parent(dev, parent, sizeof(parent))) {
+            char **tmp = realloc(parents, (parents_n + 1) * sizeof(char*));
+            if (!tmp)
+                goto fail;
+            parents = tmp;
+            if (!(parents[parents_n] = strdup(parent)))
+                goto fail;
+            parents_n++;
+        }
+
+        if (*n == alloc) {
+            struct fatlabel_dev *tmp = realloc(*devs, (alloc += alloc >> 1) * sizeof(struct fatlabel_dev));
+            if (!tmp)
+                goto fail;
+            *devs = tmp;
+        }
+        struct fatlabel_dev *d = &(*devs)[*n];
+        if (asprintf(&d->path, "/dev/%s", dev) < 0)
+            goto fail;
+        (*n)++;
+        d->dev = makedev(major, minor);
+        d->size = size;
+        d->rank = 0;
+    }
+    fclose(f);
+
+    size_t j = 0;
+    for (size_t i = 0; i < *n; i++) {
+        bool partitioned = false;
+        for (size_t k = 0; k < parents_n && !partitioned; k++)
+            partitioned = parents[k] && !strcmp((*devs)[i].path + strlen("/dev/"), parents[k]);
+        if (partitioned)
+            free((*devs)[i].path);
+        else
+            (*devs)[j++] = (*devs)[i];
+    }
+    *n = j;
+
+    for (size_t k = 0; k < parents_n; k++)
+        free(parents[k]);
+    free(parents);
+    return 0;
+
+fail:;
+    int err = errno;
+    fclose(f);
+    if (*devs)
+        fatlabel_devices_free(*devs, *n);
+    *devs = NULL;
+    *n = 0;
+    for (size_t k = 0; k < parents_n; k++)
+        free(parents[k]);
+    free(parents);
+    errno = err;
+    return -1;
+}
+
+/* fatlabel_mbr_type checks if an MBR partition type is for FAT. */
+static bool fatlabel_mbr_type(uint8_t type) {
+    switch (type) {
+    case 0x01: // FAT12
+    case 0x04: // FAT16 (< 32 MiB)
+    case 0x06: // FAT16
+    case 0x0B: // FAT32 (CHS)
+    case 0x0C: // FAT32 (LBA)
+    case 0x0E: // FAT16 (LBA)
+        return true;
+    }
+    return false;
+}
+
+/* fatlabel_udev_mbr_type gets the MBR partition type of a device from udev's
+ * database, so the disk doesn't need to be opened (it could be the one which is
+ * hung). It returns -1 if it isn't known (e.g. it isn't an MBR partition, or
+ * udev isn't running).
+ */
+static int fatlabel_udev_mbr_type(dev_t dev) {
+    char path[PATH_MAX], line[256];
+    int l = snprintf(path, sizeof(path), "%s/b%u:%u", FATLABEL_UDEV_DATA, major(dev), minor(dev));
+    if (l < 0 || (size_t) l >= sizeof(path))
+        return -1;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    bool dos = false;
+    long type = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strcmp(line, "E:ID_PART_ENTRY_SCHEME=dos\n"))
+            dos = true;
+        else if (!strncmp(line, "E:ID_PART_ENTRY_TYPE=", 21))
+            type = strtol(line + 21, NULL, 16);
+    }
+    fclose(f);
+    return dos && type >= 0 && type <= 0xFF ? (int) type : -1;
+}
+
+/* fatlabel_devices_rank sorts devices so the ones most likely to be FAT are
+ * probed first:
+ *
+ *   0. MBR partitions with a FAT type
+ *   1. anything we don't know about (GPT partitions, unpartitioned disks, loop
+ *      devices, partitions udev doesn't know the type of, etc)
+ *   2. MBR partitions with some other type
+ *   3. device-mapper and md devices
+ *
+ * Removable devices are put before fixed ones with the same rank. Only sysfs
+ * and udev's database are read, so this never blocks on a device.
+ */
+static void fatlabel_devices_rank(struct fatlabel_dev *devs, size_t n) {
+    char buf[32], parent[256];
+
+    for (size_t i = 0; i < n; i++) {
+        const char *name = devs[i].path + strlen("/dev/");
+        const char *disk = name;
+        int rank = 1;
+
+        if (!strncmp(name, "dm-", 3) || !strncmp(name, "md", 2)) {
+            rank = 3;
+        } else if (!fatlabel_sysfs_parent(name, parent, sizeof(parent))) {
+            disk = parent;
+            int type = fatlabel_udev_mbr_type(devs[i].dev);
+            if (type == 0xEE || type <= 0x00) // GPT protective or unknown
+                rank = 1;
+            else if (fatlabel_mbr_type(type))
+                rank = 0;
+            else
+                rank = 2;
+        }
+
+        bool removable = !fatlabel_sysfs(disk, "removable", buf, sizeof(buf)) && buf[0] == '1';
+        devs[i].rank = rank * 2 + !removable;
+    }
+
+    // insertion sort, since it's stable and the list is short
+    for (size_t i = 1; i < n; i++) {
+        struct fatlabel_dev d = devs[i];
+        size_t j = i;
+        for (; j && devs[j - 1].rank > d.rank; j--)
+            devs[j] = devs[j - 1];
+        devs[j] = d;
+    }
+}
+
+/* fatlabel_by_label lists the devices which udev found with a label (not
+ * case-sensitive). This doesn't open any devices, but the symlinks may be out
+ * of date (or use the other label), so they still need to be probed. On error
+ * (e.g. if udev isn't running), -1 is returned and errno is set.
+ */
+static int fatlabel_by_label(const char *label, struct fatlabel_dev **devs, size_t *n) {
+    DIR *dir = opendir(FATLABEL_BY_LABEL);
+    if (!dir)
+        return -1;
+
+    struct dirent *de;
+    struct stat st;
+    char name[256], path[PATH_MAX], real[PATH_MAX];
+    *n = 0;
+    *devs = NULL;
+    while ((de = readdir(dir))) {
+        // udev escapes spaces, slashes, etc as \xNN
+        size_t l = 0;
+        for (const char *c = de->d_name; *c && l < sizeof(name) - 1; c++) {
+            unsigned int x;
+            if (c[0] == '\\' && c[1] == 'x' && sscanf(c + 2, "%2x", &x) == 1 && c[2] && c[3]) {
+                name[l++] = x;
+                c += 3;
+            } else {
+                name[l++] = *c;
+            }
+        }
+        name[l] = '\0';
+        if (strcasecmp(name, label))
+            continue;
+
+        int r = snprintf(path, sizeof(path), "%s/%s", FATLABEL_BY_LABEL, de->d_name);
+        if (r < 0 || (size_t) r >= sizeof(path) || !realpath(path, real) || stat(real, &st) || !S_ISBLK(st.st_mode))
+            continue;
+
+        struct fatlabel_dev *tmp = realloc(*devs, (*n + 1) * sizeof(struct fatlabel_dev));
+        if (!tmp)
+            goto fail;
+        *devs = tmp;
+        (*devs)[*n] = (struct fatlabel_dev) {
+            .path = strdup(real),
+            .dev  = st.st_rdev,
+        };
+        if (!(*devs)[*n].path)
+            goto fail;
+        (*n)++;
+    }
+    closedir(dir);
+    return 0;
+
+fail:;
+    int err = errno;
+    closedir(dir);
+    if (*devs)
+        fatlabel_devices_free(*devs, *n);
+    *devs = NULL;
+    *n = 0;
+    errno = err;
+    return -1;
+}
+
+/* fatlabel_pool probes a list of devices using up to FATLABEL_THREADS detached
+ * threads. It is reference counted so the caller can stop waiting before all
+ * probes are done (a probe which is stuck in the kernel can't be cancelled),
+ * and is freed along with the devices and data when the last thread is done.
+ */
+struct fatlabel_pool {
+    pthread_mutex_t mut;
+    pthread_cond_t  cond;
+    int             refs;
+    bool            stop;  // don't start any more probes
+    size_t          next;  // next device to probe
+    size_t          done;  // number of finished (or hung) probes
+    ssize_t         match; // device which stopped the pool, or -1
+    struct fatlabel_dev *devs;
+    size_t          n;
+    uint8_t        *state; // FATLABEL_POOL_* for each device
+    struct timespec *start; // when each probe was started
+    // probe is called from the worker threads for each device, and returns
+    // true to stop the pool (e.g. on the first match).
+    bool          (*probe)(void *data, size_t i, const struct fatlabel_dev *dev);
+    void           *data;
+    void          (*free_data)(void *data);
+};
+
+#define FATLABEL_POOL_PENDING 0
+#define FATLABEL_POOL_RUNNING 1
+#define FATLABEL_POOL_DONE    2
+#define FATLABEL_POOL_HUNG    3
+
+static void fatlabel_pool_unref(struct fatlabel_pool *p) {
+    if (--p->refs) {
+        pthread_mutex_unlock(&p->mut);
+        return;
+    }
+    pthread_mutex_unlock(&p->mut);
+    pthread_mutex_destroy(&p->mut);
+    pthread_cond_destroy(&p->cond);
+    fatlabel_devices_free(p->devs, p->n);
+    if (p->free_data)
+        p->free_data(p->data);
+    free(p->state);
+    free(p->start);
+    free(p);
+}
+
+static void* fatlabel_pool_worker(void *arg) {
+    struct fatlabel_pool *p = arg;
+    pthread_mutex_lock(&p->mut);
+    while (!p->stop && p->next < p->n) {
+        size_t i = p->next++;
+        p->state[i] = FATLABEL_POOL_RUNNING;
+        clock_gettime(CLOCK_MONOTONIC, &p->start[i]);
+        pthread_cond_broadcast(&p->cond); // for the device timeout
+        pthread_mutex_unlock(&p->mut);
+
+        bool stop = p->probe(p->data, i, &p->devs[i]);
+
+        pthread_mutex_lock(&p->mut);
+        bool hung = p->state[i] == FATLABEL_POOL_HUNG;
+        if (!hung) {
+            p->state[i] = FATLABEL_POOL_DONE;
+            p->done++;
+        }
+        if (stop && !p->stop) {
+            p->stop = true;
+            p->match = i;
+        }
+        pthread_cond_broadcast(&p->cond);
+
+        // another thread was started to replace this one
+        if (hung)
+            break;
+    }
+    fatlabel_pool_unref(p);
+    return NULL;
+}
+
+/* fatlabel_pool_spawn starts a worker thread. The pool must be locked. On
+ * error, -1 is returned and errno is set.
+ */
+static int fatlabel_pool_spawn(struct fatlabel_pool *p) {
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&t, &attr, fatlabel_pool_worker, p);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    p->refs++;
+    return 0;
+}
+
+/* fatlabel_pool_new creates a pool for the specified devices (or the ones in
+ * /proc/partitions if NULL), taking ownership of them. On error, data is freed,
+ * NULL is returned, and errno is set.
+ */
+static struct fatlabel_pool* fatlabel_pool_new(struct fatlabel_dev *devs, size_t n, bool (*probe)(void*, size_t, const struct fatlabel_dev*), void *data, void (*free_data)(void*)) {
+    struct fatlabel_pool *p = calloc(1, sizeof(struct fatlabel_pool));
+    if (p && devs) {
+        p->devs = devs;
+        p->n = n;
+    }
+    if (!p || (!devs && fatlabel_devices(&p->devs, &p->n)) ||
+        !(p->state = calloc(p->n + 1, sizeof(uint8_t))) ||
+        !(p->start = calloc(p->n + 1, sizeof(struct timespec)))) {
+        int err = errno;
+        if (p && p->devs)
+            fatlabel_devices_free(p->devs, p->n);
+        else if (devs)
+            fatlabel_devices_free(devs, n);
+        if (free_data)
+            free_data(data);
+        if (p)
+            free(p->state);
+        free(p);
+        errno = err;
+        return NULL;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&p->mut, NULL);
+    pthread_cond_init(&p->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    p->refs = 1;
+    p->match = -1;
+    p->probe = probe;
+    p->data = data;
+    p->free_data = free_data;
+    return p;
+}
+
+static void fatlabel_timespec_add(struct timespec *ts, int ms) {
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long) (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static int fatlabel_timespec_cmp(const struct timespec *a, const struct timespec *b) {
+    if (a->tv_sec != b->tv_sec)
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+    return a->tv_nsec < b->tv_nsec ? -1 : a->tv_nsec > b->tv_nsec;
+}
+
+/* fatlabel_pool_run starts the worker threads, and waits until the pool is
+ * stopped, all devices have been probed, or the deadline in opts (which may be
+ * NULL) is reached. Probes which take longer than the device timeout are
+ * reported, skipped, and replaced with a new thread. The pool is locked
+ * afterwards, and must be released with fatlabel_pool_unref. If the deadline
+ * was reached, -1 is returned and errno is set to ETIMEDOUT (otherwise, 0 is
+ * returned).
+ */
+static int fatlabel_pool_run(struct fatlabel_pool *p, const struct fatlabel_search_opts *opts) {
+    struct timespec deadline, now;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if (opts && opts->timeout_ms > 0)
+        fatlabel_timespec_add(&deadline, opts->timeout_ms);
+
+    pthread_mutex_lock(&p->mut);
+    size_t threads = 0;
+    while (threads < FATLABEL_THREADS && threads < p->n && !fatlabel_pool_spawn(p))
+        threads++;
+
+    if (!threads) {
+        // fall back to probing in the current thread
+        p->refs++;
+        pthread_mutex_unlock(&p->mut);
+        fatlabel_pool_worker(p);
+        pthread_mutex_lock(&p->mut);
+    }
+
+    while (!p->stop && p->done < p->n) {
+        if (!opts || (opts->timeout_ms <= 0 && opts->device_timeout_ms <= 0)) {
+            pthread_cond_wait(&p->cond, &p->mut);
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (opts->timeout_ms > 0 && fatlabel_timespec_cmp(&now, &deadline) >= 0) {
+            p->stop = true;
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        struct timespec wake = deadline;
+        bool has_wake = opts->timeout_ms > 0;
+        for (size_t i = 0; i < p->next && opts->device_timeout_ms > 0; i++) {
+            if (p->state[i] != FATLABEL_POOL_RUNNING)
+                continue;
+            struct timespec t = p->start[i];
+            fatlabel_timespec_add(&t, opts->device_timeout_ms);
+            if (fatlabel_timespec_cmp(&now, &t) >= 0) {
+                p->state[i] = FATLABEL_POOL_HUNG;
+                p->done++;
+                if (opts->hung)
+                    opts->hung(opts->data, p->devs[i].path);
+                if (p->next < p->n)
+                    fatlabel_pool_spawn(p);
+            } else if (!has_wake || fatlabel_timespec_cmp(&t, &wake) < 0) {
+                wake = t;
+                has_wake = true;
+            }
+        }
+
+        if (p->done == p->n)
+            break;
+        if (has_wake)
+            pthread_cond_timedwait(&p->cond, &p->mut, &wake);
+        else
+            pthread_cond_wait(&p->cond, &p->mut);
+    }
+    p->stop = true;
+    return 0;
+}
+
+/* fatlabel_search_data is passed to the search probes. It is owned by the
+ * pool, since probes may still be running after the search returns.
+ */
+struct fatlabel_search_data {
+    char *label;
+    struct fatlabel_probe_stats *stats; // for each device, or NULL if there isn't an observer
+};
+
+static struct fatlabel_search_data* fatlabel_search_data_new(const char *label, size_t n, bool stats) {
+    struct fatlabel_search_data *sd = calloc(1, sizeof(struct fatlabel_search_data));
+    if (sd && (sd->label = strdup(label)) && (!stats || !n || (sd->stats = calloc(n, sizeof(struct fatlabel_probe_stats)))))
+        return sd;
+    if (sd)
+        free(sd->label);
+    free(sd);
+    return NULL;
+}
+
+static void fatlabel_search_data_free(void *data) {
+    struct fatlabel_search_data *sd = data;
+    free(sd->label);
+    free(sd->stats);
+    free(sd);
+}
+
+static uint64_t fatlabel_since_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* fatlabel_search_open opens a device for a search probe, and starts its
+ * stats. On error, -1 is returned and errno is set.
+ */
+static int fatlabel_search_open(struct fatlabel_search_data *sd, size_t i, const struct fatlabel_dev *dev, struct timespec *start) {
+    struct fatlabel_io io;
+    clock_gettime(CLOCK_MONOTONIC, start);
+    fatlabel_io(&io, true);
+    int fd = open(dev->path, O_RDONLY);
+    if (sd->stats) {
+        sd->stats[i].open_us = sd->stats[i].total_us = fatlabel_since_us(start);
+        if (fd < 0) {
+            sd->stats[i].result = FATLABEL_PROBE_ERROR;
+            sd->stats[i].error = errno;
+        }
+    }
+    return fd;
+}
+
+/* fatlabel_search_close closes a device after a search probe, and finishes its
+ * stats using the return value and errno of the probe.
+ */
+static bool fatlabel_search_close(struct fatlabel_search_data *sd, size_t i, int fd, const struct timespec *start, int r, bool matches) {
+    int err = errno;
+    close(fd);
+    if (sd->stats) {
+        struct fatlabel_io io;
+        struct fatlabel_probe_stats *st = &sd->stats[i];
+        fatlabel_io(&io, true);
+        st->result = matches ? FATLABEL_PROBE_MATCH : !r ? FATLABEL_PROBE_NO_MATCH : err == EINVAL ? FATLABEL_PROBE_NOT_FAT : FATLABEL_PROBE_ERROR;
+        st->error = st->result == FATLABEL_PROBE_ERROR ? err : 0;
+        st->total_us = fatlabel_since_us(start);
+        st->reads = io.reads;
+        st->bytes = io.bytes;
+    }
+    return matches;
+}
+
+static bool fatlabel_search_probe(void *data, size_t i, const struct fatlabel_dev *dev) {
+    struct fatlabel_search_data *sd = data;
+    struct fatlabel_info info = {.fat_type = 0};
+    struct timespec start;
+    int fd, r, matches;
+
+    if ((fd = fatlabel_search_open(sd, i, dev, &start)) < 0)
+        return false;
+
+    // we don't need to handle the error, as the labels will be empty if
+    // they don't exist or there is an error (the window means most devices
+    // only need a single read)
+    uint8_t *win = malloc(FATLABEL_WINDOW);
+    r = win ? fatlabel_probe(fd, &info, win, FATLABEL_WINDOW) : -1;
+
+    matches =
+        (info.boot_label[0] && strcasecmp(sd->label, info.boot_label) == 0) ||
+        (info.volume_label[0] && strcasecmp(sd->label, info.volume_label) == 0);
+
+    matches = fatlabel_search_close(sd, i, fd, &start, r, matches);
+    free(win);
+    return matches;
+}
+
+static bool fatlabel_search_probe_any(void *data, size_t i, const struct fatlabel_dev *dev) {
+    struct fatlabel_search_data *sd = data;
+    struct fatlabel_fsinfo info;
+    struct timespec start;
+    int fd, r;
+    bool matches = false;
+
+    if ((fd = fatlabel_search_open(sd, i, dev, &start)) < 0)
+        return false;
+
+    uint8_t *win = malloc(FATLABEL_WINDOW);
+    if (win && !(r = fatlabel_probe_any(fd, &info, win, FATLABEL_WINDOW)))
+        matches =
+            (info.label[0] && strcasecmp(sd->label, info.label) == 0) ||
+            (info.fat.boot_label[0] && strcasecmp(sd->label, info.fat.boot_label) == 0);
+    else if (!win)
+        r = -1;
+
+    matches = fatlabel_search_close(sd, i, fd, &start, r, matches);
+    free(win);
+    return matches;
+}
+
+/* fatlabel_search_report calls the observer (if any) for each device which was
+ * probed by a stopped search pool. The pool must be locked.
+ */
+static void fatlabel_search_report(struct fatlabel_pool *p, const struct fatlabel_search_opts *opts) {
+    struct fatlabel_search_data *sd = p->data;
+    if (!opts->probed || !sd->stats)
+        return;
+    for (size_t i = 0; i < p->next; i++) {
+        struct fatlabel_probe_stats st = {0};
+        if (p->state[i] == FATLABEL_POOL_DONE) {
+            st = sd->stats[i];
+        } else {
+            // the probe is still running, so its stats can't be read yet
+            st.result = p->state[i] == FATLABEL_POOL_HUNG ? FATLABEL_PROBE_HUNG : FATLABEL_PROBE_UNFINISHED;
+            st.total_us = fatlabel_since_us(&p->start[i]);
+        }
+        st.path = p->devs[i].path;
+        opts->probed(opts->data, &st);
+    }
+}
+
+char* fatlabel_search(const char *label) {
+    return fatlabel_search_ex(label, NULL);
+}
+
+char* fatlabel_search_ex(const char *label, const struct fatlabel_search_opts *opts) {
+    struct fatlabel_search_opts o = {0};
+    if (opts)
+        o = *opts;
+    bool (*probe)(void*, size_t, const struct fatlabel_dev*) = o.any_fs ? fatlabel_search_probe_any : fatlabel_search_probe;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // try the devices udev says have the label first, which usually means only
+    // one device needs to be opened
+    struct fatlabel_dev *devs;
+    size_t n, tried_n = 0;
+    dev_t *tried = NULL;
+    if (!fatlabel_by_label(label, &devs, &n) && n) {
+        if ((tried = malloc(n * sizeof(dev_t))))
+            for (; tried_n < n; tried_n++)
+                tried[tried_n] = devs[tried_n].dev;
+
+        struct fatlabel_search_data *sd = fatlabel_search_data_new(label, n, o.probed);
+        struct fatlabel_pool *p = sd ? fatlabel_pool_new(devs, n, probe, sd, fatlabel_search_data_free) : NULL;
+        if (!sd)
+            fatlabel_devices_free(devs, n);
+        if (p) {
+            bool timeout = fatlabel_pool_run(p, &o) < 0;
+            fatlabel_search_report(p, &o);
+            char *path = p->match >= 0 ? strdup(p->devs[p->match].path) : NULL;
+            fatlabel_pool_unref(p);
+            if (path || timeout) {
+                free(tried);
+                if (timeout)
+                    errno = ETIMEDOUT;
+                return path;
+            }
+        }
+
+        if (o.timeout_ms > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (ms >= o.timeout_ms) {
+                free(tried);
+                errno = ETIMEDOUT;
+                return NULL;
+            }
+            o.timeout_ms -= ms;
+        }
+    }
+
+    if (fatlabel_devices(&devs, &n)) {
+        free(tried);
+        return NULL;
+    }
+
+    // don't probe the by-label devices twice
+    size_t j = 0;
+    for (size_t i = 0; i < n; i++) {
+        bool skip = false;
+        for (size_t k = 0; k < tried_n && !skip; k++)
+            skip = devs[i].dev == tried[k];
+        if (skip)
+            free(devs[i].path);
+        else
+            devs[j++] = devs[i];
+    }
+    n = j;
+    free(tried);
+
+    fatlabel_devices_rank(devs, n);
+
+    // the label is copied since probes may still be running after we return
+    struct fatlabel_search_data *sd = fatlabel_search_data_new(label, n, o.probed);
+    if (!sd) {
+        fatlabel_devices_free(devs, n);
+        return NULL;
+    }
+    struct fatlabel_pool *p = fatlabel_pool_new(devs, n, probe, sd, fatlabel_search_data_free);
+    if (!p)
+        return NULL;
+
+    bool timeout = fatlabel_pool_run(p, &o) < 0;
+    fatlabel_search_report(p, &o);
+    char *path = p->match >= 0 ? strdup(p->devs[p->match].path) : NULL;
+    fatlabel_pool_unref(p);
+    errno = timeout ? ETIMEDOUT : 0;
+    return path;
+}
+
+struct fatlabel_scan {
+    struct fatlabel_volume *vols;
+    bool *ok;
+};
+
+static void fatlabel_scan_data_free(void *data) {
+    struct fatlabel_scan *sc = data;
+    free(sc->vols);
+    free(sc->ok);
+    free(sc);
+}
+
+static bool fatlabel_scan_probe(void *data, size_t i, const struct fatlabel_dev *dev) {
+    struct fatlabel_scan *sc = data;
+    uint8_t *win = malloc(FATLABEL_WINDOW);
+    if (!win)
+        return false;
+
+    int fd = open(dev->path, O_RDONLY);
+    if (fd < 0) {
+        free(win);
+        return false;
+    }
+
+    // the volume label may be missing if the root directory is corrupt
+    fatlabel_probe(fd, &sc->vols[i].info, win, FATLABEL_WINDOW);
+    sc->ok[i] = sc->vols[i].info.fat_type != 0;
+    close(fd);
+    free(win);
+    return false;
+}
+
+int fatlabel_scan_all(struct fatlabel_volume **vols, size_t *n) {
+    struct fatlabel_dev *devs;
+    size_t devs_n;
+    if (fatlabel_devices(&devs, &devs_n))
+        return -1;
+
+    struct fatlabel_scan *sc = calloc(1, sizeof(struct fatlabel_scan));
+    if (sc) {
+        sc->vols = calloc(devs_n, sizeof(struct fatlabel_volume));
+        sc->ok = calloc(devs_n, sizeof(bool));
+    }
+    if (!sc || !sc->vols || !sc->ok) {
+        fatlabel_devices_free(devs, devs_n);
+        if (sc)
+            fatlabel_scan_data_free(sc);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct fatlabel_pool *p = fatlabel_pool_new(devs, devs_n, fatlabel_scan_probe, sc, fatlabel_scan_data_free);
+    if (!p)
+        return -1;
+    fatlabel_pool_run(p, NULL);
+
+    *n = 0;
+    *vols = malloc((devs_n ? devs_n : 1) * sizeof(struct fatlabel_volume));
+    for (size_t i = 0; i < devs_n && *vols; i++) {
+        if (!sc->ok[i])
+            continue;
+        (*vols)[*n] = sc->vols[i];
+        (*vols)[*n].path = strdup(p->devs[i].path);
+        (*vols)[*n].dev = p->devs[i].dev;
+        (*n)++;
+    }
+    fatlabel_pool_unref(p);
+    return *vols ? 0 : -1;
+}
+
+void fatlabel_scan_free(struct fatlabel_volume *vols, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        free(vols[i].path);
+    free(vols);
+}
+
+int fatlabel_list_devices(char ***paths, size_t *n) {
+    struct fatlabel_dev *devs;
+    if (fatlabel_devices(&devs, n))
+        return -1;
+    if (!(*paths = malloc((*n ? *n : 1) * sizeof(char*)))) {
+        fatlabel_devices_free(devs, *n);
+        return -1;
+    }
+    for (size_t i = 0; i < *n; i++)
+        (*paths)[i] = devs[i].path;
+    free(devs);
+    return 0;
+}
+
+/* fatlabel_scan_paths_data is the pool data for fatlabel_scan_paths. */
+struct fatlabel_scan_paths_data {
+    bool (*fn)(void *data, size_t i, const char *path);
+    void  *data;
+    void (*free_data)(void *data);
+};
+
+static bool fatlabel_scan_paths_probe(void *data, size_t i, const struct fatlabel_dev *dev) {
+    struct fatlabel_scan_paths_data *sp = data;
+    return sp->fn(sp->data, i, dev->path);
+}
+
+static void fatlabel_scan_paths_free(void *data) {
+    struct fatlabel_scan_paths_data *sp = data;
+    if (sp->free_data)
+        sp->free_data(sp->data);
+    free(sp);
+}
+
+int fatlabel_scan_paths(char **paths, size_t n, bool (*fn)(void *data, size_t i, const char *path), void *data, void (*free_data)(void *data)) {
+    struct fatlabel_scan_paths_data *sp = malloc(sizeof(struct fatlabel_scan_paths_data));
+    struct fatlabel_dev *devs = calloc(n + 1, sizeof(struct fatlabel_dev));
+    if (!sp || !devs) {
+        int err = errno;
+        for (size_t i = 0; i < n; i++)
+            free(paths[i]);
+        free(paths);
+        free(sp);
+        free(devs);
+        if (free_data)
+            free_data(data);
+        errno = err;
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++)
+        devs[i].path = paths[i];
+    free(paths);
+    *sp = (struct fatlabel_scan_paths_data) {fn, data, free_data};
+
+    // the pool would list /proc/partitions itself if there weren't any paths
+    if (!n) {
+        free(devs);
+        fatlabel_scan_paths_free(sp);
+        return 0;
+    }
+
+    struct fatlabel_pool *p = fatlabel_pool_new(devs, n, fatlabel_scan_paths_probe, sp, fatlabel_scan_paths_free);
+    if (!p)
+        return -1;
+    fatlabel_pool_run(p, NULL);
+    fatlabel_pool_unref(p);
+    return 0;
+}
+
+void fatlabel_scan_resolve(const struct fatlabel_volume *vols, size_t n, const char **keys, size_t keys_n, const struct fatlabel_volume **out) {
+    // index the volumes by label and serial number so this is linear in the
+    // number of keys and volumes
+    size_t sz = 16;
+    while (sz < n * 6)
+        sz *= 2;
+    size_t *table = calloc(sz, sizeof(size_t));
+    char (*sernos)[10] = calloc(n ? n : 1, sizeof(*sernos));
+
+    for (size_t i = 0; i < n && table && sernos; i++) {
+        snprintf(sernos[i], sizeof(*sernos), "%04X-%04X", vols[i].info.serno >> 16, vols[i].info.serno & 0xffff);
+        const char *k[3] = {vols[i].info.boot_label, vols[i].info.volume_label, sernos[i]};
+        for (size_t j = 0; j < 3; j++) {
+            if (!k[j][0])
+                continue;
+            for (size_t h = fatlabel_hash(k[j], strlen(k[j]), true);; h++) {
+                size_t *slot = &table[h & (sz - 1)];
+                if (!*slot) {
+                    *slot = i + 1;
+                    break;
+                }
+                // keep the first volume with the key
+                const struct fatlabel_volume *v = &vols[*slot - 1];
+                if (!strcasecmp(v->info.boot_label, k[j]) || !strcasecmp(v->info.volume_label, k[j]) || !strcasecmp(sernos[*slot - 1], k[j]))
+                    break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < keys_n; i++) {
+        out[i] = NULL;
+        for (size_t h = fatlabel_hash(keys[i], strlen(keys[i]), true); table && sernos && keys[i][0]; h++) {
+            size_t slot = table[h & (sz - 1)];
+            if (!slot)
+                break;
+            const struct fatlabel_volume *v = &vols[slot - 1];
+            if (!strcasecmp(v->info.boot_label, keys[i]) || !strcasecmp(v->info.volume_label, keys[i]) || !strcasecmp(sernos[slot - 1], keys[i])) {
+                out[i] = v;
+                break;
+            }
+        }
+    }
+
+    free(sernos);
+    free(table);
+}
+
+/* fatlabel_uevent_open opens a non-blocking socket for kernel uevents. On
+ * error, -1 is returned and errno is set.
+ */
+static int fatlabel_uevent_open(void) {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_nl sa = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = 1, // kernel events (udev re-broadcasts them on 2)
+    };
+    if (bind(fd, (struct sockaddr*) &sa, sizeof(sa))) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+struct fatlabel_uevent {
+    const char *action;  // add, remove, change, etc
+    const char *devname; // relative to /dev
+    dev_t       dev;
+};
+
+/* fatlabel_uevent_recv reads the next uevent for a block device into ev, which
+ * points into buf. On error (including EAGAIN if there aren't any more events),
+ * -1 is returned and errno is set.
+ */
+static int fatlabel_uevent_recv(int fd, char *buf, size_t buf_sz, struct fatlabel_uevent *ev) {
+    for (;;) {
+        ssize_t n = recv(fd, buf, buf_sz - 1, 0);
+        if (n < 0)
+            return -1;
+        buf[n] = '\0';
+
+        bool block = false;
+        unsigned int major = 0, minor = 0;
+        *ev = (struct fatlabel_uevent) {0};
+        for (char *k = buf; k < buf + n; k += strlen(k) + 1) {
+            if (!strncmp(k, "ACTION=", 7))
+                ev->action = k + 7;
+            else if (!strncmp(k, "DEVNAME=", 8))
+                ev->devname = k + 8;
+            else if (!strcmp(k, "SUBSYSTEM=block"))
+                block = true;
+            else if (!strncmp(k, "MAJOR=", 6))
+                major = strtoul(k + 6, NULL, 10);
+            else if (!strncmp(k, "MINOR=", 6))
+                minor = strtoul(k + 6, NULL, 10);
+        }
+        if (!block || !ev->action)
+            continue;
+        ev->dev = makedev(major, minor);
+        return 0;
+    }
+}
+
+char* fatlabel_wait(const char *label, int timeout_ms) {
+    // subscribe before searching so we don't miss anything in between
+    int fd = fatlabel_uevent_open();
+    if (fd < 0)
+        return NULL;
+
+    struct timespec deadline, now;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if (timeout_ms >= 0)
+        fatlabel_timespec_add(&deadline, timeout_ms);
+
+    struct fatlabel_search_opts opts = {.timeout_ms = timeout_ms > 0 ? timeout_ms : 0};
+    char *path = fatlabel_search_ex(label, &opts);
+    if (path || timeout_ms == 0) {
+        close(fd);
+        if (!path)
+            errno = ETIMEDOUT;
+        return path;
+    }
+
+    char buf[8192];
+    struct fatlabel_uevent ev;
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    for (;;) {
+        int wait = -1;
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (fatlabel_timespec_cmp(&now, &deadline) >= 0) {
+                errno = ETIMEDOUT;
+                break;
+            }
+            wait = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000 + 1;
+        }
+
+        int r = poll(&pfd, 1, wait);
+        if (r < 0 && errno != EINTR)
+            break;
+        if (r <= 0)
+            continue;
+
+        while (!fatlabel_uevent_recv(fd, buf, sizeof(buf), &ev)) {
+            if (!ev.devname || (strcmp(ev.action, "add") && strcmp(ev.action, "change")))
+                continue;
+            struct fatlabel_dev dev = {.dev = ev.dev};
+            asprintf(&dev.path, "/dev/%s", ev.devname);
+            if (fatlabel_search_probe(&(struct fatlabel_search_data) {.label = (char*) label}, 0, &dev)) {
+                close(fd);
+                return dev.path;
+            }
+            free(dev.path);
+        }
+        if (errno == ENOBUFS) {
+            // we missed some events, so check everything again
+            if ((path = fatlabel_search(label))) {
+                close(fd);
+                return path;
+            }
+        }
+    }
+
+    int err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+}
+
+struct fatlabel_cache_ent {
+    struct fatlabel_dev dev;
+    uint64_t fingerprint; // of the boot sector (0 if it couldn't be read)
+    char *boot_label;
+    char *volume_label;
+};
+
+struct fatlabel_cache {
+    pthread_mutex_t mut;
+    int     uevent;   // uevent socket, or -1 if not available
+    bool    stale;    // whether /proc/partitions needs to be re-read
+    bool    rescan_all; // whether uevents were missed, so every device needs to be probed again
+    dev_t  *dirty;    // devices which had a uevent since the last refresh
+    size_t  dirty_n;
+    size_t  dirty_alloc;
+    struct fatlabel_cache_ent *ents;
+    size_t  n;
+    size_t *table;    // open-addressed hash table of labels (ent index + 1)
+    size_t  table_sz; // power of 2
+};
+
+static void fatlabel_cache_ent_free(struct fatlabel_cache_ent *e) {
+    free(e->dev.path);
+    free(e->boot_label);
+    free(e->volume_label);
+}
+
+static void fatlabel_cache_table_add(fatlabel_cache_t *c, const char *label, size_t i) {
+    if (!label)
+        return;
+    for (size_t h = fatlabel_hash(label, strlen(label), true);; h++) {
+        size_t *slot = &c->table[h & (c->table_sz - 1)];
+        if (!*slot) {
+            *slot = i + 1;
+            return;
+        }
+        struct fatlabel_cache_ent *e = &c->ents[*slot - 1];
+        if ((e->boot_label && !strcasecmp(e->boot_label, label)) || (e->volume_label && !strcasecmp(e->volume_label, label)))
+            return; // keep the first device with the label
+    }
+}
+
+struct fatlabel_cache_refresh {
+    struct fatlabel_cache_ent **ents; // to probe
+    struct fatlabel_cache_ent **old;  // previous entry for the device, if any
+};
+
+static bool fatlabel_cache_probe(void *data, size_t i, const struct fatlabel_dev *dev) {
+    struct fatlabel_cache_refresh *r = data;
+    struct fatlabel_cache_ent *e = r->ents[i], *o = r->old[i];
+    char *err;
+    uint8_t bs[512];
+
+    int fd = open(dev->path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    if (pread(fd, bs, sizeof(bs), 0) == sizeof(bs))
+        e->fingerprint = fatlabel_hash(bs, sizeof(bs), false);
+
+    if (e->fingerprint && o && o->fingerprint == e->fingerprint) {
+        e->boot_label = o->boot_label ? strdup(o->boot_label) : NULL;
+        e->volume_label = o->volume_label ? strdup(o->volume_label) : NULL;
+    } else {
+        fatlabel_get(fd, &e->boot_label, &e->volume_label, &err);
+        free(err);
+    }
+
+    close(fd);
+    return false;
+}
+
+/* fatlabel_cache_refresh updates the cache after processing pending uevents.
+ * The cache must be locked.
+ */
+static void fatlabel_cache_refresh(fatlabel_cache_t *c) {
+    char buf[8192];
+    struct fatlabel_uevent ev;
+    if (c->uevent < 0) {
+        c->stale = true;
+    } else {
+        while (!fatlabel_uevent_recv(c->uevent, buf, sizeof(buf), &ev)) {
+            c->stale = true;
+            if (c->dirty_n == c->dirty_alloc) {
+                size_t alloc = c->dirty_alloc ? c->dirty_alloc * 2 : 8;
+                dev_t *dirty = realloc(c->dirty, alloc * sizeof(dev_t));
+                if (!dirty) {
+                    // we can't remember it, so re-check everything
+                    c->rescan_all = true;
+                    continue;
+                }
+                c->dirty = dirty;
+                c->dirty_alloc = alloc;
+            }
+            c->dirty[c->dirty_n++] = ev.dev;
+        }
+        if (errno == ENOBUFS) {
+            // we missed some events, so re-check everything
+            c->stale = true;
+            c->rescan_all = true;
+        }
+    }
+    if (!c->stale)
+        return;
+
+    struct fatlabel_dev *devs;
+    size_t n, todo_n = 0, table_sz;
+    if (fatlabel_devices(&devs, &n))
+        return;
+
+    // build the new entries and table separately, so the old ones are kept
+    // (and the cache stays stale) if anything fails
+    struct fatlabel_cache_ent *ents = calloc(n + 1, sizeof(struct fatlabel_cache_ent));
+    if (ents)
+        for (size_t i = 0; i < n; i++)
+            ents[i].dev = devs[i];
+    else
+        for (size_t i = 0; i < n; i++)
+            free(devs[i].path);
+    free(devs);
+
+    for (table_sz = 16; table_sz < n * 4; table_sz *= 2);
+    size_t *table = calloc(table_sz, sizeof(size_t));
+    struct fatlabel_cache_refresh r = {
+        .ents = calloc(n + 1, sizeof(struct fatlabel_cache_ent*)),
+        .old  = calloc(n + 1, sizeof(struct fatlabel_cache_ent*)),
+    };
+    struct fatlabel_dev *todo = calloc(n + 1, sizeof(struct fatlabel_dev));
+    if (!ents || !table || !r.ents || !r.old || !todo)
+        goto fail;
+
+    for (size_t i = 0; i < n; i++) {
+        struct fatlabel_cache_ent *e = &ents[i], *o = NULL;
+        for (size_t j = 0; j < c->n && !o; j++)
+            if (c->ents[j].dev.dev == e->dev.dev && c->ents[j].dev.size == e->dev.size)
+                o = &c->ents[j];
+
+        bool dirty = c->uevent < 0 || c->rescan_all;
+        for (size_t j = 0; j < c->dirty_n && !dirty && o; j++)
+            dirty = c->dirty[j] == e->dev.dev;
+
+        if (o && !dirty) {
+            e->fingerprint = o->fingerprint;
+            if ((o->boot_label && !(e->boot_label = strdup(o->boot_label))) ||
+                (o->volume_label && !(e->volume_label = strdup(o->volume_label))))
+                goto fail;
+            continue;
+        }
+
+        if (!(todo[todo_n].path = strdup(e->dev.path)))
+            goto fail;
+        todo[todo_n].dev = e->dev.dev;
+        todo[todo_n].size = e->dev.size;
+        r.ents[todo_n] = e;
+        r.old[todo_n] = o;
+        todo_n++;
+    }
+
+    if (todo_n) {
+        // the pool takes ownership of todo, even on error
+        struct fatlabel_pool *p = fatlabel_pool_new(todo, todo_n, fatlabel_cache_probe, &r, NULL);
+        todo = NULL;
+        if (!p)
+            goto fail;
+        fatlabel_pool_run(p, NULL);
+        fatlabel_pool_unref(p);
+    }
+    free(todo);
+    free(r.ents);
+    free(r.old);
+
+    for (size_t i = 0; i < c->n; i++)
+        fatlabel_cache_ent_free(&c->ents[i]);
+    free(c->ents);
+    c->ents = ents;
+    c->n = n;
+
+    free(c->table);
+    c->table = table;
+    c->table_sz = table_sz;
+    for (size_t i = 0; i < n; i++) {
+        fatlabel_cache_table_add(c, ents[i].boot_label, i);
+        fatlabel_cache_table_add(c, ents[i].volume_label, i);
+    }
+
+    c->stale = false;
+    c->rescan_all = false;
+    c->dirty_n = 0;
+    return;
+
+fail:
+    if (todo)
+        fatlabel_devices_free(todo, todo_n);
+    if (ents)
+        for (size_t i = 0; i < n; i++)
+            fatlabel_cache_ent_free(&ents[i]);
+    free(ents);
+    free(table);
+    free(r.ents);
+    free(r.old);
+}
+
+fatlabel_cache_t* fatlabel_cache_new(void) {
+    fatlabel_cache_t *c = calloc(1, sizeof(fatlabel_cache_t));
+    if (!c)
+        return NULL;
+    pthread_mutex_init(&c->mut, NULL);
+    c->uevent = fatlabel_uevent_open();
+    c->stale = true;
+    return c;
+}
+
+char* fatlabel_cache_search(fatlabel_cache_t *c, const char *label) {
+    char *path = NULL;
+    pthread_mutex_lock(&c->mut);
+    fatlabel_cache_refresh(c);
+    for (size_t h = fatlabel_hash(label, strlen(label), true); c->table; h++) {
+        size_t slot = c->table[h & (c->table_sz - 1)];
+        if (!slot)
+            break;
+        struct fatlabel_cache_ent *e = &c->ents[slot - 1];
+        if ((e->boot_label && !strcasecmp(e->boot_label, label)) || (e->volume_label && !strcasecmp(e->volume_label, label))) {
+            path = strdup(e->dev.path);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&c->mut);
+    return path;
+}
+
+void fatlabel_cache_free(fatlabel_cache_t *c) {
+    if (c->uevent >= 0)
+        close(c->uevent);
+    for (size_t i = 0; i < c->n; i++)
+        fatlabel_cache_ent_free(&c->ents[i]);
+    free(c->ents);
+    free(c->table);
+    free(c->dirty);
+    pthread_mutex_destroy(&c->mut);
+    free(c);
 }
 #endif
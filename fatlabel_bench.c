@@ -0,0 +1,345 @@
+// fatlabel_bench - v1 - measure fatlabel_get on generated FAT images
+// gcc -Wall -std=c99 -O2 -pthread -o fatlabel_bench fatlabel_bench.c
+// Copyright 2019 Patrick Gaskin
+// License: MIT License
+
+#define FATLABEL_IMPLEMENTATION
+#include "fatlabel.h"
+
+// bench_img describes a generated image. Only the metadata is written, so the
+// images are sparse (even the 64 GiB one only uses a few MiB).
+typedef struct bench_img_t {
+    const char *name;
+    int         fat;           // 12, 16, or 32
+    uint32_t    sectors;       // total number of 512-byte sectors
+    uint8_t     spc;           // sectors per cluster
+    uint16_t    root_entries;  // FAT12/16
+    uint32_t    root_clusters; // FAT32 (the chain is fragmented, one cluster apart)
+    uint32_t    label_at;      // index of the volume label entry in the root directory
+} bench_img_t;
+
+static const bench_img_t imgs[] = {
+    {"fat12-floppy",     12, 2880,      1,  224,  0,   0},
+    {"fat12-label-last", 12, 8000,      2,  512,  0,   511},
+    {"fat16-label-0",    16, 70000,     2,  512,  0,   0},
+    {"fat16-label-last", 16, 70000,     4,  512,  0,   511},
+    {"fat16-root-4096",  16, 524288,    16, 4096, 0,   4095},
+    {"fat32-4k-label-0", 32, 600000,    8,  0,    1,   0},
+    {"fat32-512-chain",  32, 600000,    1,  0,    256, 256*16 - 1},
+    {"fat32-4k-chain",   32, 4194304,   8,  0,    64,  64*128 - 1},
+    {"fat32-32k-64g",    32, 134217728, 64, 0,    4,   4*1024 - 1},
+};
+
+typedef struct bench_res_t {
+    uint64_t cold_ns, warm_ns; // medians
+    struct fatlabel_io io;     // of a single warm call
+    struct fatlabel_io probe;  // of fatlabel_probe with a window-sized scratch (as used by fatlabel_search)
+} bench_res_t;
+
+static int pwrite_all(int fd, const void *buf, size_t n, uint64_t off) {
+    for (size_t r = 0; r < n;) {
+        ssize_t x = pwrite(fd, (const uint8_t*) buf + r, n - r, off + r);
+        if (x < 0 && errno == EINTR)
+            continue;
+        if (x < 0)
+            return -1;
+        r += x;
+    }
+    return 0;
+}
+
+// make_img writes a FAT filesystem with a root directory of filler entries
+// and the volume label "BENCH" at img->label_at. On error, -1 is returned and
+// errno is set.
+static int make_img(int fd, const bench_img_t *img) {
+    uint32_t reserved = img->fat == 32 ? 32 : 1;
+    uint32_t root_sct = (img->root_entries * 32 + 511) / 512;
+    uint32_t fatsz = 1, clusters;
+    for (;;) {
+        clusters = (img->sectors - reserved - 2*fatsz - root_sct) / img->spc;
+        uint64_t need = img->fat == 12 ? ((uint64_t) clusters + 2) * 3 / 2 + 1 : ((uint64_t) clusters + 2) * (img->fat / 8);
+        uint32_t n = (need + 511) / 512;
+        if (n <= fatsz)
+            break;
+        fatsz = n;
+    }
+    if (fatlabel_fat_type(clusters) != img->fat) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ftruncate(fd, 0) || ftruncate(fd, (off_t) img->sectors * 512))
+        return -1;
+
+    uint8_t bs[512] = {0};
+    struct vfat_super_block *sb = (struct vfat_super_block*) bs;
+    memcpy(sb->boot_jump, "\xEB\x58\x90", 3);
+    memcpy(sb->sysid, "MSWIN4.1", 8);
+    sb->sector_size_bytes = 512;
+    sb->sectors_per_cluster = img->spc;
+    sb->reserved_sct = reserved;
+    sb->fats = 2;
+    sb->dir_entries = img->root_entries;
+    sb->sectors = img->sectors < 65536 ? img->sectors : 0;
+    sb->total_sect = img->sectors < 65536 ? 0 : img->sectors;
+    sb->media = 0xF8;
+    sb->secs_track = 63;
+    sb->heads = 255;
+    if (img->fat == 32) {
+        sb->type.fat32.fat32_length = fatsz;
+        sb->type.fat32.root_cluster = 2;
+        sb->type.fat32.insfo_sector = 1;
+        sb->type.fat32.backup_boot = 6;
+        sb->type.fat32.unknown[0] = 0x80;
+        sb->type.fat32.unknown[2] = 0x29;
+        memcpy(sb->type.fat32.serno, "\xEF\xBE\xAD\xDE", 4);
+        memcpy(sb->type.fat32.label, "BOOTLABEL  ", 11);
+        memcpy(sb->type.fat32.magic, "FAT32   ", 8);
+    } else {
+        sb->fat_length = fatsz;
+        sb->type.fat.unknown[0] = 0x80;
+        sb->type.fat.unknown[2] = 0x29;
+        memcpy(sb->type.fat.serno, "\xEF\xBE\xAD\xDE", 4);
+        memcpy(sb->type.fat.label, "BOOTLABEL  ", 11);
+        memcpy(sb->type.fat.magic, img->fat == 12 ? "FAT12   " : "FAT16   ", 8);
+    }
+    bs[510] = 0x55;
+    bs[511] = 0xAA;
+    if (pwrite_all(fd, bs, sizeof(bs), 0))
+        return -1;
+    if (img->fat == 32) {
+        uint8_t fsi[512] = {0};
+        memcpy(fsi, "RRaA", 4);
+        memcpy(fsi + 484, "rrAa\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 12); // free count and next free are unknown
+        fsi[510] = 0x55;
+        fsi[511] = 0xAA;
+        if (pwrite_all(fd, fsi, sizeof(fsi), 512) || pwrite_all(fd, bs, sizeof(bs), 6*512))
+            return -1;
+    }
+
+    // the media and EOC entries, and the root directory chain (FAT32), which
+    // uses every other cluster so it's fragmented like a real one would be
+    uint32_t last = img->fat == 32 ? 2 + 2*(img->root_clusters - 1) : 1;
+    size_t fat_n = (size_t) (last + 1) * 4;
+    uint8_t *fat = calloc(1, fat_n);
+    if (!fat)
+        return -1;
+    if (img->fat == 12) {
+        memcpy(fat, "\xF8\xFF\xFF", 3);
+        fat_n = 3;
+    } else if (img->fat == 16) {
+        memcpy(fat, "\xF8\xFF\xFF\xFF", 4);
+        fat_n = 4;
+    } else {
+        uint32_t *e = (uint32_t*) fat;
+        e[0] = 0x0FFFFFF8;
+        e[1] = 0x0FFFFFFF;
+        for (uint32_t c = 2; c <= last; c += 2)
+            e[c] = c == last ? 0x0FFFFFFF : c + 2;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (pwrite_all(fd, fat, fat_n, (uint64_t) (reserved + i*fatsz) * 512)) {
+            free(fat);
+            return -1;
+        }
+    }
+    free(fat);
+
+    // filler files (empty, so they don't need any clusters) before the label
+    size_t ents_n = img->fat == 32 ? (size_t) img->root_clusters * img->spc * 16 : img->root_entries;
+    if (img->label_at >= ents_n) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct vfat_dir_entry *ents = calloc(ents_n, sizeof(struct vfat_dir_entry));
+    if (!ents)
+        return -1;
+    for (uint32_t i = 0; i < img->label_at; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "F%07uDAT", i % 10000000);
+        memcpy(ents[i].name, name, 11);
+        ents[i].attr = 0x20;
+    }
+    memcpy(ents[img->label_at].name, "BENCH      ", 11);
+    ents[img->label_at].attr = FAT_ATTR_VOLUME_ID;
+
+    int r = 0;
+    uint64_t root_off = (uint64_t) (reserved + 2*fatsz) * 512;
+    if (img->fat != 32) {
+        r = pwrite_all(fd, ents, ents_n * sizeof(struct vfat_dir_entry), root_off);
+    } else {
+        size_t csize = (size_t) img->spc * 512;
+        for (uint32_t i = 0; i < img->root_clusters && !r; i++)
+            r = pwrite_all(fd, (uint8_t*) ents + i*csize, csize, root_off + (uint64_t) (2*i) * csize);
+    }
+    free(ents);
+    return r ? -1 : fdatasync(fd);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+// get_label calls fatlabel_get once, and checks it found the label.
+static int get_label(int fd, uint64_t *ns) {
+    char *boot_label, *volume_label, *err;
+    uint64_t start = now_ns();
+    int r = fatlabel_get(fd, &boot_label, &volume_label, &err);
+    *ns = now_ns() - start;
+    if (!r && (!volume_label || strcmp(volume_label, "BENCH")))
+        r = -1, asprintf(&err, "wrong volume label %s", volume_label ? volume_label : "(null)");
+    if (r)
+        fprintf(stderr, "Error: %s\n", err ? err : "unknown error");
+    free(boot_label);
+    free(volume_label);
+    free(err);
+    return r;
+}
+
+// probe_label calls fatlabel_probe once like fatlabel_search does, and checks
+// it found the label.
+static int probe_label(int fd, struct fatlabel_io *io) {
+    struct fatlabel_info info;
+    uint8_t *win = malloc(FATLABEL_WINDOW);
+    if (!win)
+        return -1;
+    fatlabel_io(io, true);
+    int r = fatlabel_probe(fd, &info, win, FATLABEL_WINDOW);
+    fatlabel_io(io, true);
+    free(win);
+    if (r)
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+    else if (strcmp(info.volume_label, "BENCH"))
+        r = -1, fprintf(stderr, "Error: wrong volume label %s\n", info.volume_label);
+    return r;
+}
+
+static int run(int fd, int cold_n, int warm_n, bench_res_t *res) {
+    uint64_t *ns = calloc(cold_n > warm_n ? cold_n : warm_n, sizeof(uint64_t));
+    if (!ns)
+        return -1;
+
+    // cold: the cached pages of the image are dropped before each call (they
+    // were already written back by make_img)
+    for (int i = 0; i < cold_n; i++) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        if (get_label(fd, &ns[i])) {
+            free(ns);
+            return -1;
+        }
+    }
+    qsort(ns, cold_n, sizeof(uint64_t), cmp_u64);
+    res->cold_ns = ns[cold_n / 2];
+
+    // warm: the first call fills the cache, and also gives the I/O counts
+    // (which are the same for every call)
+    fatlabel_io(&res->io, true);
+    if (get_label(fd, &ns[0])) {
+        free(ns);
+        return -1;
+    }
+    fatlabel_io(&res->io, true);
+    for (int i = 0; i < warm_n; i++) {
+        if (get_label(fd, &ns[i])) {
+            free(ns);
+            return -1;
+        }
+    }
+    qsort(ns, warm_n, sizeof(uint64_t), cmp_u64);
+    res->warm_ns = ns[warm_n / 2];
+
+    free(ns);
+    return probe_label(fd, &res->probe);
+}
+
+static void usage(const char *argv0) {
+    printf("Usage: %s [--cold N] [--warm N] [--keep] [DIR]\n", argv0);
+    printf("\nGenerates sparse FAT12/16/32 images with different cluster sizes, root\n");
+    printf("directory sizes, and volume label positions in DIR (default: /tmp), and\n");
+    printf("measures the median latency of fatlabel_get on them with a cold page cache\n");
+    printf("(default: 10 times) and a warm one (default: 1000 times), along with the\n");
+    printf("number of read syscalls and bytes read for each call. The reads and bytes\n");
+    printf("of fatlabel_probe with a FATLABEL_WINDOW scratch (the path fatlabel_search\n");
+    printf("uses) are also shown. The images are deleted afterwards unless --keep is\n");
+    printf("specified.\n");
+    printf("\nNote that unwritten parts of a sparse image read as zeros without touching\n");
+    printf("the disk, so cold numbers only include the metadata which was written.\n");
+}
+
+int main(int argc, char** argv) {
+    int cold_n = 10, warm_n = 1000;
+    bool keep = false;
+    const char *dir = "/tmp";
+    char* argv0 = argv[0];
+    for (; argc > 1 && !strncmp(argv[1], "--", 2); argc--, argv++) {
+        if (!strcmp(argv[1], "--")) {
+            argc--, argv++;
+            break;
+        } else if (!strcmp(argv[1], "--keep"))
+            keep = true;
+        else if (!strcmp(argv[1], "--cold") && argc > 2 && atoi(argv[2]) > 0)
+            cold_n = atoi(argv[2]), argc--, argv++;
+        else if (!strcmp(argv[1], "--warm") && argc > 2 && atoi(argv[2]) > 0)
+            warm_n = atoi(argv[2]), argc--, argv++;
+        else if (!strcmp(argv[1], "--help")) {
+            usage(argv0);
+            return EXIT_SUCCESS;
+        } else {
+            printf("Error: unknown option %s\n", argv[1]);
+            usage(argv0);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc > 2) {
+        usage(argv0);
+        return EXIT_FAILURE;
+    }
+    if (argc == 2)
+        dir = argv[1];
+
+    printf("%-18s %5s %7s %7s %8s %10s %10s %6s %9s %7s %9s\n", "image", "type", "cluster", "label", "root", "cold_us", "warm_us", "reads", "bytes", "p_reads", "p_bytes");
+    for (size_t i = 0; i < sizeof(imgs)/sizeof(*imgs); i++) {
+        const bench_img_t *img = &imgs[i];
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/fatlabel_bench_%s.img", dir, img->name);
+
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            printf("Error: could not open %s: %s\n", path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if (make_img(fd, img)) {
+            printf("Error: could not generate %s: %s\n", path, strerror(errno));
+            close(fd);
+            unlink(path);
+            return EXIT_FAILURE;
+        }
+
+        bench_res_t res;
+        int r = run(fd, cold_n, warm_n, &res);
+        close(fd);
+        if (!keep)
+            unlink(path);
+        if (r) {
+            printf("Error: could not get the label of %s\n", path);
+            return EXIT_FAILURE;
+        }
+
+        char root[16];
+        if (img->fat == 32)
+            snprintf(root, sizeof(root), "%uc", img->root_clusters);
+        else
+            snprintf(root, sizeof(root), "%ue", img->root_entries);
+        printf("%-18s FAT%-2d %7u %7u %8s %10.1f %10.1f %6llu %9llu %7llu %9llu\n", img->name, img->fat, img->spc * 512, img->label_at, root,
+            res.cold_ns / 1000.0, res.warm_ns / 1000.0, (unsigned long long) res.io.reads, (unsigned long long) res.io.bytes,
+            (unsigned long long) res.probe.reads, (unsigned long long) res.probe.bytes);
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,5 +1,5 @@
-// mkmbr - v1 - generate a disk image out of partition images
-// gcc -Wall -std=c99 -pedantic-errors -o mkmbr mkmbr.c
+// mkmbr - v2 - generate a disk image out of partition images
+// gcc -Wall -std=c99 -pedantic-errors -pthread -o mkmbr mkmbr.c
 // Copyright 2019 Patrick Gaskin
 // License: MIT License
 
@@ -14,11 +14,21 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define SECTOR_SIZE         512
+#define BLOCK_SIZE          4096
+#define COPY_SIZE           (1024*1024)
 #define HEADS_PER_CYLINDER  16
 #define SECTORS_PER_HEAD    63
 
@@ -40,6 +50,151 @@ int chs(uint32_t lba, chs_t* out) {
     return overflow ? -EINVAL : 0;
 }
 
+// digest_t is a simple 64-bit hash (using the xxHash64 round and merge
+// functions) used to check partitions after they are written. The input must
+// be a multiple of 32 bytes, which is always true since the partitions are
+// padded to the sector size.
+typedef struct digest_t {
+    uint64_t v[4];
+    uint64_t len;
+} digest_t;
+
+#define DIGEST_P1 11400714785074694791ULL
+#define DIGEST_P2 14029467366897019727ULL
+#define DIGEST_P4  9650029242287828579ULL
+
+static inline uint64_t digest_round(uint64_t acc, uint64_t in) {
+    acc += in * DIGEST_P2;
+    acc  = (acc << 31) | (acc >> 33);
+    return acc * DIGEST_P1;
+}
+
+void digest_init(digest_t* d) {
+    d->v[0] = DIGEST_P1 + DIGEST_P2;
+    d->v[1] = DIGEST_P2;
+    d->v[2] = 0;
+    d->v[3] = -DIGEST_P1;
+    d->len  = 0;
+}
+
+void digest_update(digest_t* d, const uint8_t* buf, size_t n) {
+    assert(n % 32 == 0);
+    uint64_t w[4];
+    for (const uint8_t* end = buf + n; buf < end; buf += 32) {
+        memcpy(w, buf, 32);
+        for (size_t i = 0; i < 4; i++)
+            d->v[i] = digest_round(d->v[i], w[i]);
+    }
+    d->len += n;
+}
+
+uint64_t digest_final(digest_t* d) {
+    uint64_t h = ((d->v[0] << 1)  | (d->v[0] >> 63)) + ((d->v[1] << 7)  | (d->v[1] >> 57)) +
+                 ((d->v[2] << 12) | (d->v[2] >> 52)) + ((d->v[3] << 18) | (d->v[3] >> 46));
+    for (size_t i = 0; i < 4; i++)
+        h = (h ^ digest_round(0, d->v[i])) * DIGEST_P1 + DIGEST_P4;
+    h ^= d->len;
+    h ^= h >> 33; h *= DIGEST_P2;
+    h ^= h >> 29; h *= DIGEST_P1 + DIGEST_P2;
+    h ^= h >> 32;
+    return h;
+}
+
+// is_zero_* check if a buffer is entirely zero. The length must be a multiple
+// of 64 bytes, which is always true since everything is padded to the sector
+// size. The best one for the current CPU is chosen at runtime by is_zero.
+static bool is_zero_scalar(const uint8_t* buf, size_t n) {
+    uint64_t w[8];
+    for (const uint8_t* end = buf + n; buf < end; buf += 64) {
+        memcpy(w, buf, 64);
+        if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])
+            return false;
+    }
+    return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static bool is_zero_sse2(const uint8_t* buf, size_t n) {
+    for (const uint8_t* end = buf + n; buf < end; buf += 64) {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*) buf),      _mm_loadu_si128((const __m128i*) (buf+16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*) (buf+32)), _mm_loadu_si128((const __m128i*) (buf+48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+            return false;
+    }
+    return true;
+}
+
+__attribute__((target("avx2")))
+static bool is_zero_avx2(const uint8_t* buf, size_t n) {
+    const uint8_t* end = buf + n;
+    for (; buf + 128 <= end; buf += 128) {
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*) buf),      _mm256_loadu_si256((const __m256i*) (buf+32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*) (buf+64)), _mm256_loadu_si256((const __m256i*) (buf+96))));
+        if (!_mm256_testz_si256(v, v))
+            return false;
+    }
+    if (buf < end) {
+        __m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i*) buf), _mm256_loadu_si256((const __m256i*) (buf+32)));
+        if (!_mm256_testz_si256(v, v))
+            return false;
+    }
+    return true;
+}
+#elif defined(__ARM_NEON)
+static bool is_zero_neon(const uint8_t* buf, size_t n) {
+    for (const uint8_t* end = buf + n; buf < end; buf += 64) {
+        uint8x16_t v = vorrq_u8(vorrq_u8(vld1q_u8(buf), vld1q_u8(buf+16)), vorrq_u8(vld1q_u8(buf+32), vld1q_u8(buf+48)));
+        uint64x2_t w = vreinterpretq_u64_u8(v);
+        if (vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1))
+            return false;
+    }
+    return true;
+}
+#endif
+
+static bool is_zero_resolve(const uint8_t* buf, size_t n);
+static bool (*is_zero)(const uint8_t* buf, size_t n) = is_zero_resolve;
+
+static bool is_zero_resolve(const uint8_t* buf, size_t n) {
+    is_zero = is_zero_scalar;
+    #if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        is_zero = is_zero_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        is_zero = is_zero_sse2;
+    #elif defined(__ARM_NEON)
+    is_zero = is_zero_neon;
+    #endif
+    return is_zero(buf, n);
+}
+
+// block_run returns the length of the run of blocks at the start of buf which
+// are either all zero or all non-zero (zero is set accordingly). buf is at off
+// in the output, and blocks are blk bytes aligned to the start of the output,
+// so skipped runs line up with the blocks the filesystem can leave as holes.
+static size_t block_run(const uint8_t* buf, size_t n, uint64_t off, size_t blk, bool* zero) {
+    size_t r = 0;
+    for (size_t b; r < n; r += b) {
+        b = blk - (off + r) % blk;
+        if (b > n - r)
+            b = n - r;
+        bool z = is_zero(buf + r, b);
+        if (r == 0)
+            *zero = z;
+        else if (z != *zero)
+            break;
+    }
+    return r;
+}
+
+// mkmbr writes an MBR disk image to out. If out_digests is not NULL, the
+// digest of each partition (including the padding) is stored in it for use
+// with mkmbr_verify. If sparse is true and out is a regular file, blocks of
+// zeros are skipped over rather than written.
 int mkmbr(
     uint8_t  bootstrap[446],
     size_t   bootstrap_sz,
@@ -49,8 +204,10 @@ int mkmbr(
     uint8_t  partition_types[4],
     size_t   partitions_sz,
 
+    bool     sparse,
     bool     verbose,
     char**   out_err,
+    uint64_t out_digests[4],
     FILE*    out
 ) {
     #define reterr(rc, ...) { int ret = rc; if (out_err) asprintf(out_err, __VA_ARGS__); return ret ? ret : 1; }
@@ -63,12 +220,18 @@ int mkmbr(
     if (!out)
         reterr(-EINVAL, "out must point to a FILE");
 
+    struct stat sb;
+    size_t blk = BLOCK_SIZE;
+    if (sparse && (fstat(fileno(out), &sb) || !S_ISREG(sb.st_mode)))
+        sparse = false;
+    else if (sparse && sb.st_blksize > 0)
+        blk = sb.st_blksize;
+
     // Arrange partitions
     uint64_t partition_pad[4]        = {UINT64_MAX};
     uint32_t partition_lbas[4]       = {UINT32_MAX};
     uint32_t partition_lba_counts[4] = {UINT32_MAX};
 
-    struct stat sb;
     uint32_t cur_sector = 1;
     for (size_t i = 0; i < partitions_sz; i++) {
         if (stat(partition_files[i], &sb))
@@ -134,22 +297,67 @@ int mkmbr(
     assert(ftell(out)-bs == SECTOR_SIZE);
 
     // Write partitions
+    uint8_t* buf = malloc(COPY_SIZE);
+    if (!buf)
+        reterr(errno, "error allocating copy buffer: %s", strerror(errno));
+    #undef reterr
+    #define reterr(rc, ...) { int ret = rc; if (out_err) asprintf(out_err, __VA_ARGS__); free(buf); return ret ? ret : 1; }
+
+    uint64_t off = ftell(out);
     for (size_t i = 0; i < partitions_sz; i++) {
         FILE* f = fopen(partition_files[i], "rb");
         if (!f)
             reterr(errno, "error opening file '%s' for partition: %s", partition_files[i], strerror(errno));
-        int c;
-        while ((c = fgetc(f)) != EOF) {
-            fputc_((uint8_t) c, out, "partition contents");
+
+        digest_t d;
+        digest_init(&d);
+
+        size_t n;
+        uint64_t rem = (uint64_t) partition_lba_counts[i] * SECTOR_SIZE;
+        while (rem > 0 && (n = fread(buf, 1, rem < COPY_SIZE ? rem : COPY_SIZE, f)) > 0) {
+            if (n % SECTOR_SIZE) {
+                // last chunk (fread only returns less at EOF or on error)
+                size_t pad = SECTOR_SIZE - (n % SECTOR_SIZE);
+                memset(buf + n, 0, pad);
+                n += pad;
+            }
+            digest_update(&d, buf, n);
+            if (sparse) {
+                bool zero;
+                for (size_t o = 0, r; o < n; o += r) {
+                    r = block_run(buf + o, n - o, off + o, blk, &zero);
+                    if (!zero) {
+                        fwrite_(buf + o, 1, r, out, "partition contents");
+                    } else if (fseek(out, r, SEEK_CUR)) {
+                        reterr(errno, "error seeking over empty blocks: %s", strerror(errno));
+                    }
+                }
+            } else {
+                fwrite_(buf, 1, n, out, "partition contents");
+            }
+            off += n;
+            rem -= n;
+        }
+        if (ferror(f)) {
+            int err = errno;
+            fclose(f);
+            reterr(err, "error reading file '%s' for partition: %s", partition_files[i], strerror(err));
         }
         fclose(f);
 
-        for (size_t pad = partition_pad[i]; pad > 0; pad--)
-            fputc_((uint8_t) 0x00, out, "partition padding");
+        if (rem != 0)
+            reterr(-EIO, "partition file '%s' changed size while copying", partition_files[i]);
+        if (out_digests)
+            out_digests[i] = digest_final(&d);
 
         assert((ftell(out)-bs)%SECTOR_SIZE == 0);
     }
 
+    // extend the file if it ended with a skipped block
+    if (sparse && (fflush(out) || ftruncate(fileno(out), ftell(out))))
+        reterr(errno, "error extending sparse output: %s", strerror(errno));
+    free(buf);
+
     assert((ftell(out)-bs)/SECTOR_SIZE == cur_sector);
 
     return 0;
@@ -159,6 +367,128 @@ int mkmbr(
     #undef reterr
 }
 
+typedef struct verify_part_t {
+    int      fd;
+    off_t    off;
+    uint64_t len;
+    uint64_t digest;
+    int      err;
+} verify_part_t;
+
+static void* verify_part(void* arg) {
+    verify_part_t* p = arg;
+    digest_t d;
+    digest_init(&d);
+
+    uint8_t* buf = malloc(COPY_SIZE);
+    if (!buf) {
+        p->err = errno;
+        return NULL;
+    }
+
+    off_t off = p->off, end = p->off + p->len;
+    while (off < end) {
+        // skip over holes (they read as zeros anyways) in sparse images
+        off_t data = lseek(p->fd, off, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            data = end;
+        if (data > off) {
+            if (data > end)
+                data = end;
+            memset(buf, 0, COPY_SIZE);
+            for (off_t n; off < data; off += n) {
+                n = data - off < COPY_SIZE ? data - off : COPY_SIZE;
+                digest_update(&d, buf, n);
+            }
+            continue;
+        }
+
+        size_t n = end - off < COPY_SIZE ? end - off : COPY_SIZE;
+        ssize_t r = pread(p->fd, buf, n, off);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0 || r % SECTOR_SIZE) {
+            p->err = r < 0 ? errno : EIO;
+            break;
+        }
+        digest_update(&d, buf, r);
+        off += r;
+    }
+
+    free(buf);
+    p->digest = digest_final(&d);
+    return NULL;
+}
+
+// mkmbr_verify reads back the partitions from an image or device written by
+// mkmbr (at offset base) and checks them against the digests returned by it.
+// The partitions are read directly from the device after dropping them from
+// the page cache, and each one is checked in parallel. The output must have
+// been synced to the disk before calling this.
+int mkmbr_verify(const char* path, off_t base, uint64_t digests[4], size_t partitions_sz, bool verbose, char** out_err) {
+    #define reterr(rc, ...) { int ret = rc; if (out_err) asprintf(out_err, __VA_ARGS__); if (fd >= 0) close(fd); return ret ? ret : 1; }
+    int fd = -1;
+    if (partitions_sz > 4 || !digests)
+        reterr(-EINVAL, "at most 4 partitions must be defined");
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        reterr(errno, "error opening %s: %s", path, strerror(errno));
+
+    // drop the cached pages so they are actually read back from the disk
+    if ((errno = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED)))
+        reterr(errno, "error dropping cache for %s: %s", path, strerror(errno));
+
+    uint8_t mbr[SECTOR_SIZE];
+    if (pread(fd, mbr, SECTOR_SIZE, base) != SECTOR_SIZE)
+        reterr(errno ? errno : -EIO, "error reading mbr: %s", strerror(errno ? errno : EIO));
+    if (mbr[510] != 0x55 || mbr[511] != 0xAA)
+        reterr(-EIO, "mbr magic does not match");
+
+    verify_part_t parts[4];
+    pthread_t threads[4];
+    for (size_t i = 0; i < partitions_sz; i++) {
+        uint32_t lba, lba_count;
+        memcpy(&lba, &mbr[446 + 16*i + 8], 4);
+        memcpy(&lba_count, &mbr[446 + 16*i + 12], 4);
+        parts[i] = (verify_part_t) {
+            .fd  = fd,
+            .off = base + (off_t) lba * SECTOR_SIZE,
+            .len = (uint64_t) lba_count * SECTOR_SIZE,
+        };
+        if ((errno = pthread_create(&threads[i], NULL, verify_part, &parts[i]))) {
+            int err = errno;
+            while (i--)
+                pthread_join(threads[i], NULL);
+            reterr(err, "error starting verification thread: %s", strerror(err));
+        }
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < partitions_sz; i++) {
+        pthread_join(threads[i], NULL);
+        if (verbose)
+            printf("verify partition %zu @ %ld+%lu: %016lx (expected %016lx)\n", i, (long) parts[i].off, parts[i].len, parts[i].digest, digests[i]);
+        if (ret)
+            continue;
+        if (parts[i].err) {
+            if (out_err)
+                asprintf(out_err, "error reading partition %zu: %s", i+1, strerror(parts[i].err));
+            ret = parts[i].err;
+        } else if (parts[i].digest != digests[i]) {
+            if (out_err)
+                asprintf(out_err, "partition %zu does not match (got %016lx, expected %016lx)", i+1, parts[i].digest, digests[i]);
+            ret = -EIO;
+        }
+    }
+
+    close(fd);
+    return ret;
+    #undef reterr
+}
+
+// MKMBR_NO_MAIN can be defined to include mkmbr.c in something else (e.g.
+// mkmbr_bench.c).
+#ifndef MKMBR_NO_MAIN
 int main(int argc, char** argv) {
     short int word = 0x0001;
     char *b = (char *)&word;
@@ -167,12 +497,27 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
 
+    char* argv0 = argv[0];
+    bool verify = false, sparse = false;
+    for (; argc > 1 && !strncmp(argv[1], "--", 2); argc--, argv++) {
+        if (!strcmp(argv[1], "--verify"))
+            verify = true;
+        else if (!strcmp(argv[1], "--sparse"))
+            sparse = true;
+        else {
+            printf("Error: unknown option %s\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+    }
+
     if (argc != 6 && argc != 8 && argc != 10 && argc != 12) {
-        printf("Usage: %s OUT_PATH BOOTSTRAP_PATH ACTIVE_PARTITION_NUM PARTITION1_FILE PARTITION1_TYPE [PARTITION2_FILE PARTITION2_TYPE [PARTITION3_FILE PARTITION3_TYPE [PARTITION4_FILE PARTITION4_TYPE]]]\n", argv[0]);
+        printf("Usage: %s [--verify] [--sparse] OUT_PATH BOOTSTRAP_PATH ACTIVE_PARTITION_NUM PARTITION1_FILE PARTITION1_TYPE [PARTITION2_FILE PARTITION2_TYPE [PARTITION3_FILE PARTITION3_TYPE [PARTITION4_FILE PARTITION4_TYPE]]]\n", argv0);
         printf("\nExamples:\n");
         printf("    mkmbr disk.img \"\" 1 partition1.fat16 0x0E\n");
         printf("    mkmbr disk.img bootstrap.bin 1 partition1.fat16 0x0E\n");
         printf("    mkmbr disk.img bootstrap.bin 1 partition1.fat16 0x0E partition2.ext4 0x53\n");
+        printf("    mkmbr --sparse disk.img \"\" 1 partition1.fat16 0x0E partition2.ext4 0x53\n");
+        printf("    mkmbr --verify /dev/sdb bootstrap.bin 1 partition1.fat16 0x0E\n");
         return EXIT_FAILURE;
     }
 
@@ -245,10 +590,24 @@ int main(int argc, char** argv) {
     }
 
     char* err;
-    if (mkmbr(bootstrap, bootstrap_sz, partition_active, partition_files, partition_types, partitions_sz, true, &err, f)) {
+    uint64_t digests[4];
+    if (mkmbr(bootstrap, bootstrap_sz, partition_active, partition_files, partition_types, partitions_sz, sparse, true, &err, digests, f)) {
         printf("Error: could not generate image: %s\n", err);
         return EXIT_FAILURE;
     }
 
+    if (fflush(f) || fsync(fileno(f))) {
+        printf("Error: could not sync output: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
     fclose(f);
+
+    if (verify) {
+        if (mkmbr_verify(out_path, 0, digests, partitions_sz, true, &err)) {
+            printf("Error: verification failed: %s\n", err);
+            return EXIT_FAILURE;
+        }
+        printf("verified %lu partitions\n", partitions_sz);
+    }
 }
+#endif
@@ -0,0 +1,151 @@
+// mkmbr_bench - v1 - measure the zero-block detection used by mkmbr --sparse
+// gcc -Wall -std=c99 -O2 -pthread -o mkmbr_bench mkmbr_bench.c
+// Copyright 2019 Patrick Gaskin
+// License: MIT License
+
+#define MKMBR_NO_MAIN
+#include "mkmbr.c"
+
+#include <time.h>
+
+// bench_kernel is an is_zero implementation to measure. memcmp against a
+// zeroed buffer is included as a baseline (note that it reads twice as much
+// memory, since it also reads the zeroed buffer).
+typedef struct bench_kernel_t {
+    const char *name;
+    bool      (*fn)(const uint8_t* buf, size_t n);
+    bool        ok; // whether the CPU supports it
+} bench_kernel_t;
+
+static const uint8_t* bench_zeros;
+
+static bool is_zero_memcmp(const uint8_t* buf, size_t n) {
+    return !memcmp(buf, bench_zeros, n);
+}
+
+// the buffer sizes go from L1-resident to well past the last-level cache
+static const size_t sizes[] = {
+    4*1024, 64*1024, 256*1024, 1024*1024, 16*1024*1024, 64*1024*1024,
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// run returns the best throughput (in GB/s) of runs passes over bytes (at
+// least) of buf, checked as BLOCK_SIZE blocks like mkmbr does. The buffer is
+// all zeros, which is the worst case (every byte is read).
+static double run(const bench_kernel_t *k, const uint8_t* buf, size_t n, uint64_t bytes, int runs) {
+    uint64_t iters = bytes / n ? bytes / n : 1, best = UINT64_MAX;
+    size_t blk = n < BLOCK_SIZE ? n : BLOCK_SIZE;
+    for (int r = 0; r < runs; r++) {
+        volatile bool zero = true;
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < iters; i++)
+            for (size_t o = 0; o < n; o += blk)
+                zero = k->fn(buf + o, blk) && zero;
+        uint64_t ns = now_ns() - start;
+        if (!zero)
+            return -1;
+        if (ns < best)
+            best = ns;
+    }
+    return best ? (double) (iters * n) / best : 0;
+}
+
+static void usage(const char *argv0) {
+    printf("Usage: %s [--runs N] [--bytes N]\n", argv0);
+    printf("\nMeasures the throughput of each zero-detection kernel mkmbr can use (the\n");
+    printf("ones the CPU doesn't support are skipped), and memcmp against a zeroed\n");
+    printf("buffer, on all-zero buffers from 4 KiB (L1-resident) to 64 MiB (DRAM). Each\n");
+    printf("buffer is checked in %d-byte blocks like mkmbr --sparse does, until at least\n", BLOCK_SIZE);
+    printf("--bytes (default: 1 GiB) have been checked. The best of --runs (default: 5)\n");
+    printf("is shown in GB/s. The kernel marked with * is the one mkmbr picks.\n");
+}
+
+int main(int argc, char** argv) {
+    int runs = 5;
+    uint64_t bytes = 1ULL << 30;
+    char* argv0 = argv[0];
+    for (; argc > 1 && !strncmp(argv[1], "--", 2); argc--, argv++) {
+        if (!strcmp(argv[1], "--")) {
+            argc--, argv++;
+            break;
+        } else if (!strcmp(argv[1], "--runs") && argc > 2 && atoi(argv[2]) > 0)
+            runs = atoi(argv[2]), argc--, argv++;
+        else if (!strcmp(argv[1], "--bytes") && argc > 2 && strtoull(argv[2], NULL, 0) > 0)
+            bytes = strtoull(argv[2], NULL, 0), argc--, argv++;
+        else if (!strcmp(argv[1], "--help")) {
+            usage(argv0);
+            return EXIT_SUCCESS;
+        } else {
+            printf("Error: unknown option %s\n", argv[1]);
+            usage(argv0);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc > 1) {
+        usage(argv0);
+        return EXIT_FAILURE;
+    }
+
+    bench_kernel_t kernels[] = {
+        {"scalar", is_zero_scalar, true},
+        #if defined(__x86_64__) || defined(__i386__)
+        {"sse2",   is_zero_sse2,   __builtin_cpu_supports("sse2")},
+        {"avx2",   is_zero_avx2,   __builtin_cpu_supports("avx2")},
+        #elif defined(__ARM_NEON)
+        {"neon",   is_zero_neon,   true},
+        #endif
+        {"memcmp", is_zero_memcmp, true},
+    };
+    size_t kernels_n = sizeof(kernels)/sizeof(*kernels);
+
+    // resolve is_zero so we can mark the one mkmbr uses
+    size_t max = sizes[sizeof(sizes)/sizeof(*sizes) - 1];
+    uint8_t *buf = calloc(max, 1), *zeros = calloc(max, 1);
+    if (!buf || !zeros) {
+        printf("Error: could not allocate buffers: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    bench_zeros = zeros;
+    is_zero(buf, 64);
+
+    // make sure the pages are actually there, rather than all mapped to the
+    // zero page
+    memset(buf, 0, max);
+    memset(zeros, 0, max);
+
+    printf("%-10s", "size");
+    for (size_t k = 0; k < kernels_n; k++)
+        if (kernels[k].ok)
+            printf(" %8s%c", kernels[k].name, kernels[k].fn == is_zero ? '*' : ' ');
+    printf("\n");
+
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(*sizes); i++) {
+        char size[32];
+        if (sizes[i] >= 1024*1024)
+            snprintf(size, sizeof(size), "%zu MiB", sizes[i] / (1024*1024));
+        else
+            snprintf(size, sizeof(size), "%zu KiB", sizes[i] / 1024);
+        printf("%-10s", size);
+        for (size_t k = 0; k < kernels_n; k++) {
+            if (!kernels[k].ok)
+                continue;
+            double gbs = run(&kernels[k], buf, sizes[i], bytes, runs);
+            if (gbs < 0) {
+                printf("\nError: %s didn't detect a zero buffer\n", kernels[k].name);
+                return EXIT_FAILURE;
+            }
+            printf(" %9.1f", gbs);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    free(buf);
+    free(zeros);
+    return EXIT_SUCCESS;
+}
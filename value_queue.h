@@ -0,0 +1,227 @@
+// value_queue - v1 - public domain - by Patrick Gaskin
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // syscall
+#endif
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// On Linux, threads waiting for the queue to become non-empty or non-full
+// sleep using a futex. Elsewhere (or if VALUE_QUEUE_NO_FUTEX is defined), a
+// pthread mutex and condition variable are used. Either way, they are only
+// touched if a thread actually needs to wait.
+#if defined(__linux__) && !defined(VALUE_QUEUE_NO_FUTEX)
+#define VALUE_QUEUE_FUTEX
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifndef VALUE_QUEUE_CACHE_LINE
+#define VALUE_QUEUE_CACHE_LINE 64
+#endif
+
+struct value_queue_slot {
+    size_t seq; // position of the value (if seq == pos + 1) or the next put (if seq == pos)
+    int v;
+};
+
+/*
+ * value_queue_t is like value_waiter_t, but values are queued instead of
+ * replacing each other, so every value is received exactly once and in order.
+ * It is a bounded ring where each slot has a sequence number, so any number of
+ * threads can put and get values at the same time without locking (see
+ * https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue).
+ */
+typedef struct value_queue_t {
+    struct value_queue_slot *slots;
+    size_t mask;
+    size_t head __attribute__((aligned(VALUE_QUEUE_CACHE_LINE))); // position of the next put
+    size_t tail __attribute__((aligned(VALUE_QUEUE_CACHE_LINE))); // position of the next get
+    unsigned int puts __attribute__((aligned(VALUE_QUEUE_CACHE_LINE))); // changed after a put if there are getters
+    unsigned int gets;    // changed after a get if there are putters
+    int          getters; // number of threads waiting for a value
+    int          putters; // number of threads waiting for space
+#ifndef VALUE_QUEUE_FUTEX
+    pthread_mutex_t mut;
+    pthread_cond_t cond;
+#endif
+} value_queue_t;
+
+/*
+ * vq_init initializes the value queue to hold up to cap values (rounded up to
+ * a power of two). On error, -1 is returned and errno is set. vq_destroy must
+ * be called afterwards.
+ */
+static inline int vq_init(struct value_queue_t* vq, size_t cap) {
+    size_t n = 2;
+    while (n < cap)
+        n *= 2;
+    *vq = (value_queue_t) {.mask = n - 1};
+    if (!(vq->slots = calloc(n, sizeof(struct value_queue_slot))))
+        return -1;
+    for (size_t i = 0; i < n; i++)
+        vq->slots[i].seq = i;
+#ifndef VALUE_QUEUE_FUTEX
+    pthread_mutex_init(&vq->mut, NULL);
+    pthread_cond_init(&vq->cond, NULL);
+#endif
+    return 0;
+}
+
+/*
+ * vq_destroy frees the value queue. It must not be used afterwards (unless it
+ * is initialized again).
+ */
+static inline void vq_destroy(struct value_queue_t* vq) {
+    free(vq->slots);
+    vq->slots = NULL;
+#ifndef VALUE_QUEUE_FUTEX
+    pthread_mutex_destroy(&vq->mut);
+    pthread_cond_destroy(&vq->cond);
+#endif
+}
+
+// vq_sleep waits until ev might not be equal to val anymore.
+static inline void vq_sleep(struct value_queue_t* vq, unsigned int* ev, unsigned int val) {
+#ifdef VALUE_QUEUE_FUTEX
+    (void) vq;
+    syscall(SYS_futex, ev, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&vq->mut);
+    if (__atomic_load_n(ev, __ATOMIC_ACQUIRE) == val)
+        pthread_cond_wait(&vq->cond, &vq->mut);
+    pthread_mutex_unlock(&vq->mut);
+#endif
+}
+
+// vq_notify changes ev and wakes a thread sleeping on it, but only if there
+// are any threads waiting (so it's just a load when the queue is flowing).
+static inline void vq_notify(struct value_queue_t* vq, unsigned int* ev, int* waiters) {
+    // this pairs with the fence after registering a waiter in vq_put and
+    // vq_get: either we see the waiter, or it sees what we just published
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(waiters, __ATOMIC_RELAXED))
+        return;
+    __atomic_add_fetch(ev, 1, __ATOMIC_RELEASE);
+#ifdef VALUE_QUEUE_FUTEX
+    (void) vq;
+    syscall(SYS_futex, ev, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&vq->mut);
+    pthread_cond_broadcast(&vq->cond);
+    pthread_mutex_unlock(&vq->mut);
+#endif
+}
+
+/*
+ * vq_try_put puts a value if there is space, and returns whether it did. It
+ * doesn't wake threads waiting in vq_get, so use vq_put(vq, v, false) instead.
+ */
+static inline bool vq_try_put(struct value_queue_t* vq, int v) {
+    struct value_queue_slot* s;
+    size_t pos = __atomic_load_n(&vq->head, __ATOMIC_RELAXED);
+    for (;;) {
+        s = &vq->slots[pos & vq->mask];
+        size_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            // on failure, pos is updated to the current head
+            if (__atomic_compare_exchange_n(&vq->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return false; // the slot still has the value from the last lap
+        } else {
+            pos = __atomic_load_n(&vq->head, __ATOMIC_RELAXED);
+        }
+    }
+    s->v = v;
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * vq_try_get gets a value if there is one, and returns whether it did. It
+ * doesn't wake threads waiting in vq_put, so use vq_get(vq, v, false) instead.
+ */
+static inline bool vq_try_get(struct value_queue_t* vq, int* v) {
+    struct value_queue_slot* s;
+    size_t pos = __atomic_load_n(&vq->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        s = &vq->slots[pos & vq->mask];
+        size_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&vq->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return false; // the value for this lap hasn't been put yet
+        } else {
+            pos = __atomic_load_n(&vq->tail, __ATOMIC_RELAXED);
+        }
+    }
+    *v = s->v;
+    __atomic_store_n(&s->seq, pos + vq->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * vq_put adds a value to the end of the queue. If the queue is full, it waits
+ * for space if wait is true, or returns false otherwise.
+ */
+static inline bool vq_put(struct value_queue_t* vq, int v, bool wait) {
+    while (!vq_try_put(vq, v)) {
+        if (!wait)
+            return false;
+
+        // register as a waiter before trying again, so a get after this will
+        // either change gets or be seen by the retry
+        __atomic_add_fetch(&vq->putters, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        unsigned int ev = __atomic_load_n(&vq->gets, __ATOMIC_ACQUIRE);
+        bool ok = vq_try_put(vq, v);
+        if (!ok)
+            vq_sleep(vq, &vq->gets, ev);
+        __atomic_sub_fetch(&vq->putters, 1, __ATOMIC_RELAXED);
+        if (ok)
+            break;
+    }
+    vq_notify(vq, &vq->puts, &vq->getters);
+    return true;
+}
+
+/*
+ * vq_get removes the value at the start of the queue and stores it in v. If
+ * the queue is empty, it waits for a value if wait is true, or returns false
+ * otherwise. Each value is received by exactly one thread.
+ */
+static inline bool vq_get(struct value_queue_t* vq, int* v, bool wait) {
+    while (!vq_try_get(vq, v)) {
+        if (!wait)
+            return false;
+
+        __atomic_add_fetch(&vq->getters, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        unsigned int ev = __atomic_load_n(&vq->puts, __ATOMIC_ACQUIRE);
+        bool ok = vq_try_get(vq, v);
+        if (!ok)
+            vq_sleep(vq, &vq->puts, ev);
+        __atomic_sub_fetch(&vq->getters, 1, __ATOMIC_RELAXED);
+        if (ok)
+            break;
+    }
+    vq_notify(vq, &vq->gets, &vq->putters);
+    return true;
+}
+
+/*
+ * vq_has checks if there is a value available. Note that to avoid race
+ * conditions, you should use vq_get instead.
+ */
+static inline bool vq_has(struct value_queue_t* vq) {
+    size_t pos = __atomic_load_n(&vq->tail, __ATOMIC_RELAXED);
+    return __atomic_load_n(&vq->slots[pos & vq->mask].seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
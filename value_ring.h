@@ -0,0 +1,190 @@
+// value_ring - v1 - public domain - by Patrick Gaskin
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // syscall
+#endif
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+// On Linux, a thread waiting for the ring to become non-empty or non-full can
+// sleep using a futex (if enabled in vr_init). Otherwise, it spins and yields.
+#ifdef __linux__
+#define VALUE_RING_FUTEX
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#ifndef VALUE_RING_CACHE_LINE
+#define VALUE_RING_CACHE_LINE 64
+#endif
+
+#ifndef VALUE_RING_SPIN
+#define VALUE_RING_SPIN 128 // number of times to check before sleeping or yielding
+#endif
+
+/*
+ * value_ring_t passes fixed-size items from one producer thread to one
+ * consumer thread in order, without any locking. The indices written by each
+ * side are on separate cache lines, and each side keeps a copy of the other's
+ * index, which it only reloads when the ring looks full (or empty). Items are
+ * copied and published in batches, so passing many items at once only costs
+ * one store and one notification per batch.
+ */
+typedef struct value_ring_t {
+    uint8_t *buf;
+    size_t   size;  // of each item
+    size_t   mask;  // number of items - 1
+    bool     sleep; // whether waiting threads sleep (otherwise they yield)
+
+    size_t head __attribute__((aligned(VALUE_RING_CACHE_LINE))); // position of the next put (written by the producer)
+    size_t tail_cache; // last tail seen by the producer
+
+    size_t tail __attribute__((aligned(VALUE_RING_CACHE_LINE))); // position of the next get (written by the consumer)
+    size_t head_cache; // last head seen by the consumer
+
+    unsigned int puts __attribute__((aligned(VALUE_RING_CACHE_LINE))); // changed after a put if the consumer is sleeping
+    unsigned int gets;   // changed after a get if the producer is sleeping
+    int          getter; // whether the consumer is (about to be) sleeping
+    int          putter; // whether the producer is (about to be) sleeping
+} value_ring_t;
+
+/*
+ * vr_init initializes the ring to hold up to cap items (rounded up to a power
+ * of two) of size bytes each. If sleep is true, threads which need to wait
+ * will sleep after a short spin (on Linux), which is better unless both
+ * threads have their own core and latency matters more than CPU usage. On
+ * error, -1 is returned and errno is set. vr_destroy must be called
+ * afterwards.
+ */
+static inline int vr_init(struct value_ring_t* vr, size_t size, size_t cap, bool sleep) {
+    size_t n = 1;
+    while (n < cap)
+        n *= 2;
+    *vr = (value_ring_t) {.size = size, .mask = n - 1, .sleep = sleep};
+    return (vr->buf = malloc(n * size)) ? 0 : -1;
+}
+
+/*
+ * vr_destroy frees the ring. It must not be used afterwards (unless it is
+ * initialized again).
+ */
+static inline void vr_destroy(struct value_ring_t* vr) {
+    free(vr->buf);
+    vr->buf = NULL;
+}
+
+static inline void vr_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// vr_wait waits until the other side's index isn't old anymore, by spinning,
+// then sleeping on ev (or yielding).
+static inline void vr_wait(struct value_ring_t* vr, size_t* idx, size_t old, unsigned int* ev, int* waiting) {
+    for (int i = 0; i < VALUE_RING_SPIN; i++) {
+        if (__atomic_load_n(idx, __ATOMIC_ACQUIRE) != old)
+            return;
+        vr_pause();
+    }
+#ifdef VALUE_RING_FUTEX
+    if (vr->sleep) {
+        // this pairs with the fence in vr_notify: either the other side sees
+        // that we're waiting, or we see its new index
+        __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        unsigned int val = __atomic_load_n(ev, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(idx, __ATOMIC_ACQUIRE) == old)
+            syscall(SYS_futex, ev, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+        __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+        return;
+    }
+#endif
+    sched_yield();
+}
+
+// vr_notify wakes the other side if it is sleeping.
+static inline void vr_notify(struct value_ring_t* vr, unsigned int* ev, int* waiting) {
+#ifdef VALUE_RING_FUTEX
+    if (!vr->sleep)
+        return;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(waiting, __ATOMIC_RELAXED))
+        return;
+    __atomic_add_fetch(ev, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, ev, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
+/*
+ * vr_put copies up to n items to the ring, and returns the number copied. If
+ * wait is true, it waits for space until all of them are copied. Otherwise,
+ * it copies as many as will fit. It must only be called by the producer.
+ */
+static inline size_t vr_put(struct value_ring_t* vr, const void* items, size_t n, bool wait) {
+    const uint8_t* src = items;
+    size_t cap = vr->mask + 1, done = 0;
+    size_t head = __atomic_load_n(&vr->head, __ATOMIC_RELAXED);
+    while (done < n) {
+        if (head - vr->tail_cache == cap) {
+            vr->tail_cache = __atomic_load_n(&vr->tail, __ATOMIC_ACQUIRE);
+            if (head - vr->tail_cache == cap) {
+                if (!wait)
+                    break;
+                vr_wait(vr, &vr->tail, vr->tail_cache, &vr->gets, &vr->putter);
+                continue;
+            }
+        }
+
+        // copy as much as fits (wrapping around the end of the buffer) and
+        // publish it all at once
+        size_t k = cap - (head - vr->tail_cache), i = head & vr->mask;
+        if (k > n - done)
+            k = n - done;
+        size_t first = k < cap - i ? k : cap - i;
+        memcpy(vr->buf + i * vr->size, src + done * vr->size, first * vr->size);
+        memcpy(vr->buf, src + (done + first) * vr->size, (k - first) * vr->size);
+        head += k;
+        done += k;
+        __atomic_store_n(&vr->head, head, __ATOMIC_RELEASE);
+        vr_notify(vr, &vr->puts, &vr->getter);
+    }
+    return done;
+}
+
+/*
+ * vr_get copies up to n items from the ring, and returns the number copied.
+ * If wait is true and the ring is empty, it waits for at least one item (but
+ * doesn't wait for all n). It must only be called by the consumer.
+ */
+static inline size_t vr_get(struct value_ring_t* vr, void* items, size_t n, bool wait) {
+    uint8_t* dst = items;
+    size_t cap = vr->mask + 1;
+    size_t tail = __atomic_load_n(&vr->tail, __ATOMIC_RELAXED);
+    if (!n)
+        return 0;
+    while (vr->head_cache == tail) {
+        vr->head_cache = __atomic_load_n(&vr->head, __ATOMIC_ACQUIRE);
+        if (vr->head_cache != tail)
+            break;
+        if (!wait)
+            return 0;
+        vr_wait(vr, &vr->head, tail, &vr->puts, &vr->getter);
+    }
+
+    size_t k = vr->head_cache - tail, i = tail & vr->mask;
+    if (k > n)
+        k = n;
+    size_t first = k < cap - i ? k : cap - i;
+    memcpy(dst, vr->buf + i * vr->size, first * vr->size);
+    memcpy(dst + first * vr->size, vr->buf, (k - first) * vr->size);
+    __atomic_store_n(&vr->tail, tail + k, __ATOMIC_RELEASE);
+    vr_notify(vr, &vr->gets, &vr->putter);
+    return k;
+}
@@ -1,8 +1,30 @@
-// value_waiter - v3 - public domain - by Patrick Gaskin
+// value_waiter - v5 - public domain - by Patrick Gaskin
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // syscall
+#endif
 #include <stdbool.h>
-#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+// On Linux, the value is an atomic int which threads wait on using a futex, so
+// vw_put and vw_get only make a syscall if a thread needs to sleep or be woken.
+// Elsewhere (or if VALUE_WAITER_NO_FUTEX is defined), a pthread mutex and
+// condition variable are used.
+#if defined(__linux__) && !defined(VALUE_WAITER_NO_FUTEX)
+#define VALUE_WAITER_FUTEX
+#endif
 
-#define VALUE_WAITER_INITIALIZER {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0}
+#ifdef VALUE_WAITER_FUTEX
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#define VALUE_WAITER_INITIALIZER {0, 0, -1}
+#else
+#include <pthread.h>
+#define VALUE_WAITER_INITIALIZER {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, -1}
+#endif
 
 /*
  * value_waiter_t lets a thread pass a value to another thread waiting
@@ -12,9 +34,15 @@
  * to be received at most once.
  */
 typedef struct value_waiter_t {
+#ifdef VALUE_WAITER_FUTEX
+    int v;       // the futex word (zero if there isn't a value)
+    int waiters; // number of threads which are (or are about to be) sleeping in vw_get
+#else
     pthread_mutex_t mut;
     pthread_cond_t cond;
     int v;
+#endif
+    int fd;      // eventfd which is readable while there is a value, or -1
 } value_waiter_t;
 
 /*
@@ -26,12 +54,67 @@ static inline void vw_init(struct value_waiter_t* vw) {
     *vw = (value_waiter_t) VALUE_WAITER_INITIALIZER;
 }
 
+#ifdef __linux__
+/*
+ * vw_init_fd is like vw_init, but also creates an eventfd which becomes
+ * readable when a value is put, so the value waiter can be used with poll or
+ * epoll (see vw_fd). On error, -1 is returned and errno is set. vw_destroy
+ * must be called to close it.
+ */
+static inline int vw_init_fd(struct value_waiter_t* vw) {
+    vw_init(vw);
+    return (vw->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ? -1 : 0;
+}
+#endif
+
+/*
+ * vw_fd returns the eventfd created by vw_init_fd, or -1. It is readable
+ * whenever a value is available, and is reset by vw_get. It may sometimes be
+ * readable when a value isn't available (e.g. if another thread took it
+ * first), so use vw_get(vw, false) and ignore zero values when it is.
+ */
+static inline int vw_fd(struct value_waiter_t* vw) {
+    return vw->fd;
+}
+
+/*
+ * vw_destroy frees the resources used by the value waiter. It must not
+ * be used afterwards (unless it is initialized again).
+ */
+static inline void vw_destroy(struct value_waiter_t* vw) {
+    if (vw->fd >= 0)
+        close(vw->fd);
+    vw->fd = -1;
+#ifndef VALUE_WAITER_FUTEX
+    pthread_mutex_destroy(&vw->mut);
+    pthread_cond_destroy(&vw->cond);
+#endif
+}
+
+// vw_notify makes the eventfd (if any) readable.
+static inline void vw_notify(struct value_waiter_t* vw) {
+    uint64_t x = 1;
+    if (vw->fd >= 0 && write(vw->fd, &x, sizeof(x))) {}
+}
+
+// vw_drain resets the eventfd (if any). It must be done before taking the
+// value, so a value put afterwards will make it readable again.
+static inline void vw_drain(struct value_waiter_t* vw) {
+    uint64_t x;
+    if (vw->fd >= 0 && read(vw->fd, &x, sizeof(x))) {}
+}
+
 /*
  * vw_clear clears the stored value, and can be used to ignore all values
  * previously stored.
  */
 static inline void vw_clear(struct value_waiter_t* vw) {
+    vw_drain(vw);
+#ifdef VALUE_WAITER_FUTEX
+    __atomic_store_n(&vw->v, 0, __ATOMIC_RELEASE);
+#else
     vw->v = 0;
+#endif
 }
 
 /*
@@ -40,10 +123,21 @@ static inline void vw_clear(struct value_waiter_t* vw) {
  * the values will not queue, each replaces the previous one).
  */
 static inline void vw_put(struct value_waiter_t* vw, int v) {
+#ifdef VALUE_WAITER_FUTEX
+    // this pairs with the increment in vw_get (both are seq_cst): either we
+    // see the waiter, or its FUTEX_WAIT sees the value and doesn't sleep
+    if (!__atomic_exchange_n(&vw->v, v, __ATOMIC_SEQ_CST) && v)
+        vw_notify(vw);
+    if (v && __atomic_load_n(&vw->waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &vw->v, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
     pthread_mutex_lock(&vw->mut);
+    if (!vw->v && v)
+        vw_notify(vw);
     vw->v = v;
     pthread_cond_signal(&vw->cond);
     pthread_mutex_unlock(&vw->mut);
+#endif
 }
 
 /*
@@ -57,6 +151,17 @@ static inline void vw_put(struct value_waiter_t* vw, int v) {
  * return zero if there is none available.
  */
 static inline int vw_get(struct value_waiter_t* vw, bool wait) {
+#ifdef VALUE_WAITER_FUTEX
+    int v;
+    while (vw_drain(vw), !(v = __atomic_exchange_n(&vw->v, 0, __ATOMIC_ACQ_REL)) && wait) {
+        __atomic_add_fetch(&vw->waiters, 1, __ATOMIC_SEQ_CST);
+        // returns right away if a value was put since the exchange (and if
+        // another thread takes it first, we'll just wait again)
+        syscall(SYS_futex, &vw->v, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+        __atomic_sub_fetch(&vw->waiters, 1, __ATOMIC_RELAXED);
+    }
+    return v;
+#else
     pthread_mutex_lock(&vw->mut);
     int v = vw->v;
     while (wait && !(v = vw->v))
@@ -64,6 +169,7 @@ static inline int vw_get(struct value_waiter_t* vw, bool wait) {
     vw_clear(vw);
     pthread_mutex_unlock(&vw->mut);
     return v;
+#endif
 }
 
 /*
@@ -71,8 +177,12 @@ static inline int vw_get(struct value_waiter_t* vw, bool wait) {
  * conditions, you should use vw_get instead.
  */
 static inline bool vw_has(struct value_waiter_t* vw) {
+#ifdef VALUE_WAITER_FUTEX
+    return __atomic_load_n(&vw->v, __ATOMIC_ACQUIRE) != 0;
+#else
     pthread_mutex_lock(&vw->mut);
     int v = vw->v;
     pthread_mutex_unlock(&vw->mut);
     return v != 0;
+#endif
 }
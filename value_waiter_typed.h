@@ -0,0 +1,275 @@
+// value_waiter_typed - v1 - public domain - by Patrick Gaskin
+//
+// Generates a value waiter (see value_waiter.h) for any type. Small values are
+// copied in and out under a seqlock. If VALUE_WAITER_BYREF is defined, pointers
+// to values are handed over instead, so large values aren't copied at all.
+// Since the value can be anything, whether there is one is tracked separately
+// (rather than using zero to mean there isn't one).
+//
+//     #define VALUE_WAITER_NAME pos
+//     #define VALUE_WAITER_TYPE struct position
+//     #include "value_waiter_typed.h"
+//
+//     vw_pos_t w;
+//     vw_pos_init(w);
+//     vw_pos_put(w, (struct position) {1, 2});
+//
+//     struct position p;
+//     if (vw_pos_get(w, &p, true)) ...
+//
+//     vw_pos_destroy(w);
+#ifndef VALUE_WAITER_TYPED_H
+#define VALUE_WAITER_TYPED_H
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // syscall
+#endif
+#include <stdbool.h>
+#include <string.h>
+#include <sched.h>
+
+// On Linux, threads wait using a futex. Elsewhere (or if VALUE_WAITER_NO_FUTEX
+// is defined), a pthread mutex and condition variable are used, like in
+// value_waiter.h.
+#if defined(__linux__) && !defined(VALUE_WAITER_NO_FUTEX)
+#define VALUE_WAITER_FUTEX
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
+#ifndef VALUE_WAITER_NAME
+#error "Must declare VALUE_WAITER_NAME"
+#endif
+
+#ifndef VALUE_WAITER_TYPE
+#error "Must declare VALUE_WAITER_TYPE"
+#endif
+
+#define VALUE_WAITER_CONCAT(x, y) x ## _ ## y
+#define VALUE_WAITER_1(x, y) VALUE_WAITER_CONCAT(x, y)
+#define VALUE_WAITER_(x) VALUE_WAITER_1(vw, VALUE_WAITER_1(VALUE_WAITER_NAME, x))
+#define VALUE_WAITER VALUE_WAITER_(t)
+
+typedef struct {
+#ifdef VALUE_WAITER_BYREF
+    VALUE_WAITER_TYPE *p;  // the value, or NULL
+    unsigned int puts;     // futex word changed after a put if there are waiters
+#else
+    unsigned int seq;      // incremented before and after each put (odd while writing)
+    unsigned int consumed; // seq of the last value taken (there is a value if it isn't seq)
+    VALUE_WAITER_TYPE v;
+#endif
+    int waiters;           // number of threads which are (or are about to be) sleeping in get
+#ifndef VALUE_WAITER_FUTEX
+    pthread_mutex_t mut;
+    pthread_cond_t cond;
+#endif
+} VALUE_WAITER_(struct);
+
+typedef VALUE_WAITER_(struct) VALUE_WAITER[1];
+
+/*
+ * init initializes the value waiter. There isn't a value initially. destroy
+ * must be called afterwards.
+ */
+static inline void VALUE_WAITER_(init)(VALUE_WAITER vw) {
+    memset(vw, 0, sizeof(VALUE_WAITER_(struct)));
+#ifndef VALUE_WAITER_FUTEX
+    pthread_mutex_init(&vw->mut, NULL);
+    pthread_cond_init(&vw->cond, NULL);
+#endif
+}
+
+/*
+ * destroy frees the resources used by the value waiter. It must not be used
+ * afterwards (unless it is initialized again). With VALUE_WAITER_BYREF, a
+ * value which wasn't taken isn't freed (use put(NULL) to get it first).
+ */
+static inline void VALUE_WAITER_(destroy)(VALUE_WAITER vw) {
+#ifdef VALUE_WAITER_FUTEX
+    (void) vw;
+#else
+    pthread_mutex_destroy(&vw->mut);
+    pthread_cond_destroy(&vw->cond);
+#endif
+}
+
+// sleep waits until ev might not be equal to val anymore.
+static inline void VALUE_WAITER_(sleep)(VALUE_WAITER vw, unsigned int *ev, unsigned int val) {
+#ifdef VALUE_WAITER_FUTEX
+    (void) vw;
+    syscall(SYS_futex, ev, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&vw->mut);
+    if (__atomic_load_n(ev, __ATOMIC_ACQUIRE) == val)
+        pthread_cond_wait(&vw->cond, &vw->mut);
+    pthread_mutex_unlock(&vw->mut);
+#endif
+}
+
+// wake wakes a thread waiting in get after a put, if there is one.
+static inline void VALUE_WAITER_(wake)(VALUE_WAITER vw, unsigned int *ev) {
+    // this pairs with the fence in get: either we see the waiter, or it sees
+    // the value we just put
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&vw->waiters, __ATOMIC_RELAXED))
+        return;
+#ifdef VALUE_WAITER_BYREF
+    __atomic_add_fetch(ev, 1, __ATOMIC_RELEASE);
+#endif
+#ifdef VALUE_WAITER_FUTEX
+    syscall(SYS_futex, ev, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    // the lock makes sure a thread in sleep either sees the new ev, or is
+    // already waiting on the condition
+    (void) ev;
+    pthread_mutex_lock(&vw->mut);
+    pthread_cond_signal(&vw->cond);
+    pthread_mutex_unlock(&vw->mut);
+#endif
+}
+
+#ifdef VALUE_WAITER_BYREF
+
+/*
+ * put stores a pointer to a value, replacing the previous one. If the previous
+ * one wasn't taken by get, it is returned so it can be freed (otherwise, NULL is
+ * returned). Putting NULL clears the value.
+ */
+static inline VALUE_WAITER_TYPE* VALUE_WAITER_(put)(VALUE_WAITER vw, VALUE_WAITER_TYPE *v) {
+    VALUE_WAITER_TYPE *old = __atomic_exchange_n(&vw->p, v, __ATOMIC_ACQ_REL);
+    if (v)
+        VALUE_WAITER_(wake)(vw, &vw->puts);
+    return old;
+}
+
+/*
+ * get takes the pointer stored, or waits for one if wait is true. If wait is
+ * false and there isn't one, NULL is returned. Each pointer is returned to at
+ * most one thread, which then owns it.
+ */
+static inline VALUE_WAITER_TYPE* VALUE_WAITER_(get)(VALUE_WAITER vw, bool wait) {
+    VALUE_WAITER_TYPE *v;
+    while (!(v = __atomic_exchange_n(&vw->p, NULL, __ATOMIC_ACQ_REL)) && wait) {
+        __atomic_add_fetch(&vw->waiters, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        unsigned int ev = __atomic_load_n(&vw->puts, __ATOMIC_ACQUIRE);
+        if (!__atomic_load_n(&vw->p, __ATOMIC_RELAXED))
+            VALUE_WAITER_(sleep)(vw, &vw->puts, ev);
+        __atomic_sub_fetch(&vw->waiters, 1, __ATOMIC_RELAXED);
+    }
+    return v;
+}
+
+/*
+ * has checks if there is a value available. Note that to avoid race
+ * conditions, you should use get instead.
+ */
+static inline bool VALUE_WAITER_(has)(VALUE_WAITER vw) {
+    return __atomic_load_n(&vw->p, __ATOMIC_RELAXED) != NULL;
+}
+
+/*
+ * clear clears the stored value, and returns it (if it wasn't taken by get) so
+ * it can be freed. It is the same as putting NULL.
+ */
+static inline VALUE_WAITER_TYPE* VALUE_WAITER_(clear)(VALUE_WAITER vw) {
+    return VALUE_WAITER_(put)(vw, NULL);
+}
+
+#else
+
+/*
+ * clear clears the stored value, and can be used to ignore all values
+ * previously stored.
+ */
+static inline void VALUE_WAITER_(clear)(VALUE_WAITER vw) {
+    // consumed only moves forwards, so a value which was put (and maybe taken)
+    // after we read seq won't be received again
+    unsigned int c = __atomic_load_n(&vw->consumed, __ATOMIC_RELAXED), s;
+    do {
+        s = __atomic_load_n(&vw->seq, __ATOMIC_ACQUIRE) & ~1u;
+    } while (s != c && !__atomic_compare_exchange_n(&vw->consumed, &c, s, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * put stores a value, replacing the previous one. It can be called by
+ * multiple threads at the same time as get (puts are serialized by the
+ * seqlock).
+ */
+static inline void VALUE_WAITER_(put)(VALUE_WAITER vw, VALUE_WAITER_TYPE v) {
+    unsigned int s = __atomic_load_n(&vw->seq, __ATOMIC_RELAXED);
+    for (;;) {
+        if (s & 1) {
+            // another put is in progress
+            sched_yield();
+            s = __atomic_load_n(&vw->seq, __ATOMIC_RELAXED);
+        } else if (__atomic_compare_exchange_n(&vw->seq, &s, s + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    vw->v = v;
+    __atomic_store_n(&vw->seq, s + 2, __ATOMIC_RELEASE);
+    VALUE_WAITER_(wake)(vw, &vw->seq);
+}
+
+/*
+ * get copies the value stored into v and takes it, or waits for one if wait
+ * is true. It returns false if wait is false and there isn't a value. Like
+ * vw_get, each value is received by at most one thread, and only the last
+ * value put is received.
+ */
+static inline bool VALUE_WAITER_(get)(VALUE_WAITER vw, VALUE_WAITER_TYPE *v, bool wait) {
+    for (;;) {
+        unsigned int s = __atomic_load_n(&vw->seq, __ATOMIC_ACQUIRE);
+        unsigned int c = __atomic_load_n(&vw->consumed, __ATOMIC_RELAXED);
+        if (s == c) {
+            if (!wait)
+                return false;
+            __atomic_add_fetch(&vw->waiters, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&vw->seq, __ATOMIC_RELAXED) == s && __atomic_load_n(&vw->consumed, __ATOMIC_RELAXED) == c)
+                VALUE_WAITER_(sleep)(vw, &vw->seq, s);
+            __atomic_sub_fetch(&vw->waiters, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (s & 1) {
+            // a put is in progress, and it won't take long
+            sched_yield();
+            continue;
+        }
+
+        // copy it, then make sure it wasn't overwritten while copying, and
+        // that nobody else took it first
+        VALUE_WAITER_TYPE tmp;
+        memcpy(&tmp, (const void*) &vw->v, sizeof(tmp));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&vw->seq, __ATOMIC_RELAXED) != s)
+            continue;
+        if (__atomic_compare_exchange_n(&vw->consumed, &c, s, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            *v = tmp;
+            return true;
+        }
+    }
+}
+
+/*
+ * has checks if there is a value available. Note that to avoid race
+ * conditions, you should use get instead.
+ */
+static inline bool VALUE_WAITER_(has)(VALUE_WAITER vw) {
+    return (__atomic_load_n(&vw->seq, __ATOMIC_ACQUIRE) | 1) != (__atomic_load_n(&vw->consumed, __ATOMIC_RELAXED) | 1);
+}
+
+#endif
+
+#undef VALUE_WAITER_1
+#undef VALUE_WAITER_
+#undef VALUE_WAITER_NAME
+#undef VALUE_WAITER_TYPE
+#undef VALUE_WAITER_BYREF
+#undef VALUE_WAITER